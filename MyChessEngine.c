@@ -1,18 +1,430 @@
+// #define ZOBRIST_DEBUG // recompute the position key after every make/unmake and report mismatches
+// #define MCE_STATS // count what move generation and make/unmake do, printed by the stats command
+// #define MCE_STATS_TIMERS // with MCE_STATS, also time them with the cycle counter
+#ifdef _MSC_VER
 #define _CRTDBG_MAP_ALLOC
 #include <crtdbg.h>
+#endif
+#ifdef _WIN32
 #include <windows.h>
+#include <malloc.h>
+#else
+#include <pthread.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+#ifdef _MSC_VER
+#include <intrin.h>
+#elif defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
+#if defined(_M_X64) || defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdbool.h>
 #include <string.h>
 #include <ctype.h>
+#include <math.h>
 
+// Platform layer. Everything below this block is plain C on top of these.
 
+// Index of the lowest set bit, bb must not be zero. Compilers turn these into tzcnt/popcnt when the target has them.
+static inline int bitScanForward(unsigned long long int bb) {
+#ifdef _MSC_VER
+    unsigned long int index;
+    _BitScanForward64(&index, bb);
+    return (int)index;
+#else
+    return __builtin_ctzll(bb);
+#endif
+}
+
+static inline int popCount(unsigned long long int bb) {
+#ifdef _MSC_VER
+    return (int)__popcnt64(bb);
+#else
+    return __builtin_popcountll(bb);
+#endif
+}
+
+// PEXT is only compiled in where the compiler is allowed to emit it, and only used if the CPU has it too
+#if defined(_MSC_VER) || defined(__BMI2__)
+#define HAVE_PEXT 1
+static inline unsigned long long int pext(unsigned long long int bb, unsigned long long int mask) {
+    return _pext_u64(bb, mask);
+}
+#else
+#define HAVE_PEXT 0
+static inline unsigned long long int pext(unsigned long long int bb, unsigned long long int mask) {
+    (void)bb;
+    (void)mask;
+    return 0;
+}
+#endif
+
+// cpuid leaf and subleaf into eax, ebx, ecx, edx. All zeros off x86, which reads as no extensions.
+static void cpuid(int info[4], int leaf, int subleaf) {
+#ifdef _MSC_VER
+    __cpuidex(info, leaf, subleaf);
+#elif defined(__x86_64__) || defined(__i386__)
+    __cpuid_count(leaf, subleaf, info[0], info[1], info[2], info[3]);
+#else
+    info[0] = info[1] = info[2] = info[3] = 0;
+#endif
+}
+
+unsigned long long int getTimeMicroseconds() {
+#ifdef _WIN32
+    // The frequency is fixed at boot, no need to ask for it on every call
+    static LARGE_INTEGER frequency;
+    LARGE_INTEGER now;
+    if (!frequency.QuadPart) QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&now);
+    return (unsigned long long int)(now.QuadPart / frequency.QuadPart * 1000000 + now.QuadPart % frequency.QuadPart * 1000000 / frequency.QuadPart);
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (unsigned long long int)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+#endif
+}
+
+// Cycle counter for timing short stretches of code, microseconds off x86
+static inline unsigned long long int readCycleCounter() {
+#if defined(_M_X64) || defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return getTimeMicroseconds();
+#endif
+}
+
+void sleepMilliseconds(int milliseconds) {
+#ifdef _WIN32
+    Sleep(milliseconds);
+#else
+    struct timespec duration = { milliseconds / 1000, (milliseconds % 1000) * 1000000L };
+    nanosleep(&duration, NULL);
+#endif
+}
+
+// Logical processors, at least 1
+int cpuCount() {
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return (info.dwNumberOfProcessors > 0) ? (int)info.dwNumberOfProcessors : 1;
+#else
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return (count > 0) ? (int)count : 1;
+#endif
+}
+
+void* alignedAlloc(size_t size, size_t alignment) {
+#ifdef _WIN32
+    return _aligned_malloc(size, alignment);
+#else
+    void* memory;
+    return (posix_memalign(&memory, alignment, size)) ? NULL : memory;
+#endif
+}
+
+void alignedFree(void* memory) {
+#ifdef _WIN32
+    _aligned_free(memory);
+#else
+    free(memory);
+#endif
+}
+
+// Maps a whole file read only. Returns NULL if it can't be opened or mapped.
+const void* mapFile(const char *path, size_t *size) {
+#ifdef _WIN32
+    HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) return NULL;
+    LARGE_INTEGER fileSize;
+    HANDLE mapping = NULL;
+    const void* data = NULL;
+    if (GetFileSizeEx(file, &fileSize) && fileSize.QuadPart > 0) {
+        mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    }
+    if (mapping != NULL) {
+        data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+        CloseHandle(mapping);
+    }
+    CloseHandle(file);
+    *size = (data != NULL) ? (size_t)fileSize.QuadPart : 0;
+    return data;
+#else
+    int file = open(path, O_RDONLY);
+    if (file < 0) return NULL;
+    struct stat status;
+    void* data = MAP_FAILED;
+    if (fstat(file, &status) == 0 && status.st_size > 0) {
+        data = mmap(NULL, (size_t)status.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+    }
+    close(file);
+    if (data == MAP_FAILED) return NULL;
+    *size = (size_t)status.st_size;
+    return data;
+#endif
+}
+
+void unmapFile(const void *data, size_t size) {
+#ifdef _WIN32
+    UnmapViewOfFile(data);
+#else
+    munmap((void*)data, size);
+#endif
+}
+
+// Reads a line from stdin without the newline. Returns false at end of input.
+bool readLine(char *buffer, int size) {
+    if (fgets(buffer, size, stdin) == NULL) return false;
+    buffer[strcspn(buffer, "\r\n")] = '\0';
+    return true;
+}
+
+// Threads and locks. A thread function is declared as THREAD_FUNCTION(name, parameter) and ends with
+// return THREAD_RETURN.
+#define MAX_THREADS 256
+#ifdef _WIN32
+typedef HANDLE Thread;
+typedef CRITICAL_SECTION Mutex;
+#define THREAD_FUNCTION(name, parameter) DWORD WINAPI name(LPVOID parameter)
+#define THREAD_RETURN 0
+typedef DWORD (WINAPI *ThreadFunction)(LPVOID);
+#else
+typedef pthread_t Thread;
+typedef pthread_mutex_t Mutex;
+#define THREAD_FUNCTION(name, parameter) void* name(void* parameter)
+#define THREAD_RETURN NULL
+typedef void* (*ThreadFunction)(void*);
+#endif
+#ifdef _MSC_VER
+#define THREAD_LOCAL __declspec(thread)
+#else
+#define THREAD_LOCAL _Thread_local
+#endif
+
+// Returns false if the thread couldn't be started
+bool startThread(Thread *thread, ThreadFunction function, void *parameter) {
+#ifdef _WIN32
+    *thread = CreateThread(NULL, 0, function, parameter, 0, NULL);
+    return *thread != NULL;
+#else
+    return pthread_create(thread, NULL, function, parameter) == 0;
+#endif
+}
+
+void joinThread(Thread thread) {
+#ifdef _WIN32
+    WaitForSingleObject(thread, INFINITE);
+    CloseHandle(thread);
+#else
+    pthread_join(thread, NULL);
+#endif
+}
+
+void initMutex(Mutex *mutex) {
+#ifdef _WIN32
+    InitializeCriticalSection(mutex);
+#else
+    pthread_mutex_init(mutex, NULL);
+#endif
+}
+
+void destroyMutex(Mutex *mutex) {
+#ifdef _WIN32
+    DeleteCriticalSection(mutex);
+#else
+    pthread_mutex_destroy(mutex);
+#endif
+}
+
+void lockMutex(Mutex *mutex) {
+#ifdef _WIN32
+    EnterCriticalSection(mutex);
+#else
+    pthread_mutex_lock(mutex);
+#endif
+}
+
+void unlockMutex(Mutex *mutex) {
+#ifdef _WIN32
+    LeaveCriticalSection(mutex);
+#else
+    pthread_mutex_unlock(mutex);
+#endif
+}
+
+// Counters and flags that one thread writes while another reads them. Counters only need to be read whole, flags
+// also publish what was written before them. MSVC gives volatile accesses exactly that on x86 and x64.
+static inline unsigned long long int loadCounter(unsigned long long int *counter) {
+#ifdef _MSC_VER
+    return *(volatile unsigned long long int*)counter;
+#else
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+#endif
+}
+
+static inline void storeCounter(unsigned long long int *counter, unsigned long long int value) {
+#ifdef _MSC_VER
+    *(volatile unsigned long long int*)counter = value;
+#else
+    __atomic_store_n(counter, value, __ATOMIC_RELAXED);
+#endif
+}
+
+static inline bool loadFlag(bool *flag) {
+#ifdef _MSC_VER
+    return *(volatile bool*)flag;
+#else
+    return __atomic_load_n(flag, __ATOMIC_ACQUIRE);
+#endif
+}
+
+static inline void storeFlag(bool *flag, bool value) {
+#ifdef _MSC_VER
+    *(volatile bool*)flag = value;
+#else
+    __atomic_store_n(flag, value, __ATOMIC_RELEASE);
+#endif
+}
+
+// Hot path counters, compiled in with MCE_STATS and printed by the stats command. Each thread counts into its own
+// thread local copy, so counting takes no lock and shares no cache line, and adds it to the totals with flushStats
+// when it ends. The command line thread lives on, it flushes when the stats are asked for.
+typedef struct {
+    unsigned long long int nodes; // moves made, perft and search alike
+    unsigned long long int generateCalls;
+    unsigned long long int countCalls; // countLegalMoves, the perft leaves
+    unsigned long long int movesGenerated[7]; // by piece type
+    unsigned long long int pinnedPieces; // pieces whose targets had to be cut down to the pin line
+    unsigned long long int epChecks; // en passant captures looked at for a discovered check
+    unsigned long long int legalityChecks; // isLegalMove, for hash moves and killers
+    unsigned long long int trialMoves; // made and unmade only to see if the king is left in check
+    unsigned long long int inCheckCalls;
+    unsigned long long int checkersCalls;
+    unsigned long long int undoGrowths;
+    unsigned long long int generateCycles;
+    unsigned long long int countCycles;
+    unsigned long long int makeCycles;
+    unsigned long long int unmakeCycles;
+} Stats;
+
+#ifdef MCE_STATS
+THREAD_LOCAL Stats threadStats;
+Stats totalStats;
+Mutex statsLock;
+#define STAT_ADD(field, count) (threadStats.field += (count))
+#else
+#define STAT_ADD(field, count) ((void)0)
+#endif
+#define STAT_INC(field) STAT_ADD(field, 1)
+// STAT_TIMER_START declares the timer, so it goes where a declaration can
+#if defined(MCE_STATS) && defined(MCE_STATS_TIMERS)
+#define STAT_TIMER_START(timer) unsigned long long int timer = readCycleCounter()
+#define STAT_TIMER_STOP(field, timer) STAT_ADD(field, readCycleCounter() - timer)
+#else
+#define STAT_TIMER_START(timer) ((void)0)
+#define STAT_TIMER_STOP(field, timer) ((void)0)
+#endif
+
+void initStats() {
+#ifdef MCE_STATS
+    initMutex(&statsLock);
+#endif
+}
+
+// Adds this thread's counts to the totals and starts it over from zero
+void flushStats() {
+#ifdef MCE_STATS
+    unsigned long long int* counts = (unsigned long long int*)&threadStats;
+    unsigned long long int* totals = (unsigned long long int*)&totalStats;
+    lockMutex(&statsLock);
+    for (size_t i = 0; i < sizeof(Stats) / sizeof(unsigned long long int); i++) totals[i] += counts[i];
+    unlockMutex(&statsLock);
+    memset(&threadStats, 0, sizeof(Stats));
+#endif
+}
+
+// Prints the totals since the last clear, counting this thread's too. Threads still running aren't in them yet.
+void printStats(bool clear) {
+#ifdef MCE_STATS
+    flushStats();
+    lockMutex(&statsLock);
+    Stats stats = totalStats;
+    if (clear) memset(&totalStats, 0, sizeof(Stats));
+    unlockMutex(&statsLock);
+    unsigned long long int generated = 0;
+    for (int piece = 1; piece <= 6; piece++) generated += stats.movesGenerated[piece];
+    printf("nodes: %llu\n", stats.nodes);
+    printf("generateMovesOfType calls: %llu, %llu moves, %.1f per call\n", stats.generateCalls, generated,
+        (stats.generateCalls) ? (double)generated / stats.generateCalls : 0.0);
+    printf("moves by piece: pawn %llu, knight %llu, bishop %llu, rook %llu, queen %llu, king %llu\n", stats.movesGenerated[1],
+        stats.movesGenerated[2], stats.movesGenerated[3], stats.movesGenerated[4], stats.movesGenerated[5], stats.movesGenerated[6]);
+    printf("countLegalMoves calls: %llu\n", stats.countCalls);
+    printf("pinned pieces: %llu\n", stats.pinnedPieces);
+    printf("en passant checks: %llu\n", stats.epChecks);
+    printf("isLegalMove checks: %llu\n", stats.legalityChecks);
+    printf("trial make/unmake: %llu\n", stats.trialMoves);
+    printf("inCheck calls: %llu\n", stats.inCheckCalls);
+    printf("checkers calls: %llu\n", stats.checkersCalls);
+    printf("undo stack growths: %llu\n", stats.undoGrowths);
+#ifdef MCE_STATS_TIMERS
+    printf("cycles: generate %.1f per call, count %.1f per call, make %.1f, unmake %.1f per move\n",
+        (stats.generateCalls) ? (double)stats.generateCycles / stats.generateCalls : 0.0,
+        (stats.countCalls) ? (double)stats.countCycles / stats.countCalls : 0.0,
+        (stats.nodes) ? (double)stats.makeCycles / stats.nodes : 0.0,
+        (stats.nodes) ? (double)stats.unmakeCycles / stats.nodes : 0.0);
+#endif
+#else
+    (void)clear;
+    printf("stats are not compiled in, build with MCE_STATS defined\n");
+#endif
+}
+
+
+// A move is from (6), to (6) and the four type flags listed above formMove (4). The pieces involved are read
+// off the board, and whatever else makeMove can't reverse by itself goes on the board's undo stack.
+typedef unsigned short Move;
+
+// Everything a move destroys, saved by makeMove so unmakeMove can put it back. 16 bytes.
+typedef struct {
+    Move move;
+    unsigned char cPiece;
+    unsigned char castlingRights; // as castlingIndex() gives them
+    unsigned char epSquareIndex; // 0 for none, h1 is never an ep square
+    unsigned short halfMoveClock;
+    unsigned long long int zobristKey;
+} Undo;
+
+// Deepest the search and perft go. A board's undo stack always has this many entries free past the game's moves,
+// so makeMove never has to grow it, and can't fail, in the middle of a search.
+#define MAX_PLY 128
+
+// One entry per move played, for the whole game. Game moves make room with reserveUndo before they are played.
 typedef struct {
-    unsigned long long int* moves;
+    Undo* entries;
     int length;
     int capacity;
-} MoveList;
+} UndoStack;
+
+// No legal position has more than 218 moves, so generated moves go into a fixed buffer that lives on the stack
+// of whoever asks for them.
+#define MAX_MOVES 256
+
+typedef struct {
+    Move moves[MAX_MOVES];
+    int length;
+} MoveBuffer;
+
+// Neurons per side in the network's hidden layer, a network file has to match it. A multiple of 16 for the kernels.
+#define NNUE_HIDDEN 256
 
 typedef struct {
     unsigned long long int pieceBB[14];
@@ -24,7 +436,15 @@ typedef struct {
     int halfMoveClock;
     int fullMoveNumber;
     int playerToMove;
-    MoveList history;
+    unsigned long long int zobristKey;
+    unsigned long long int pawnKey; // pawns only, for the pawn table
+    // Material plus piece-square values, white's view, and how much material is left for tapering between them
+    int scoreMg;
+    int scoreEg;
+    int phase;
+    // The network's first layer, from white's and black's side. Only kept up to date while a network is loaded.
+    short accumulator[2][NNUE_HIDDEN];
+    UndoStack history;
 } Board;
 
 typedef struct {
@@ -32,512 +452,642 @@ typedef struct {
     char* pieceSymbols;
 } Parameters;
 
+// Perft transposition table. The key is stored XORed with the data, so an entry that was
+// half written by another thread fails the key check instead of returning a wrong count.
+typedef struct {
+    unsigned long long int key;
+    unsigned long long int data; // node count in the top 56 bits, depth in the low 8
+} PerftEntry;
+
+// Four entries fill one 64 byte cache line, so a probe touches a single line
+typedef struct {
+    PerftEntry entries[4];
+} PerftBucket;
+
+typedef struct {
+    PerftBucket* buckets;
+    unsigned long long int bucketMask;
+    unsigned long long int probes;
+    unsigned long long int hits;
+} PerftTable;
+
+// Search transposition table. Same layout idea as the perft table: 16 byte entries with the key stored XORed with
+// the data, four to a 64 byte bucket, so threads can share it without locks and a torn entry just fails to match.
+// data holds, from the low bits up: move (16), score (16), depth (8), bound (2), age (6), 16 bits unused.
+typedef struct {
+    unsigned long long int key;
+    unsigned long long int data;
+} TTEntry;
+
+typedef struct {
+    TTEntry entries[4];
+} TTBucket;
+
+typedef struct {
+    TTBucket* buckets;
+    unsigned long long int bucketMask;
+    int age; // bumped every search, so entries from old searches are replaced first
+} TranspositionTable;
+
+#define BOUND_UPPER 1
+#define BOUND_LOWER 2
+#define BOUND_EXACT 3
+
+// Pawn structure cache, looked up by the pawn key. Each search thread has its own, so no locking.
+#define PAWN_TABLE_SIZE 8192
+
+typedef struct {
+    unsigned long long int key;
+    short scoreMg;
+    short scoreEg;
+} PawnEntry;
+
+typedef struct {
+    PawnEntry entries[PAWN_TABLE_SIZE];
+    unsigned long long int probes;
+    unsigned long long int hits;
+} PawnTable;
+
 unsigned long long int notAFile = 0x7F7F7F7F7F7F7F7FULL;
 unsigned long long int notHFile = 0xFEFEFEFEFEFEFEFEULL;
 
-void initMoveList(MoveList *ml, int capacity) {
-    ml->moves = malloc(capacity * sizeof(unsigned long long int));
-    ml->length = 0;
-    ml->capacity = capacity;
-}
+// Zobrist keys. Castling uses one key per combination of the four rights (K = 1, Q = 2, k = 4, q = 8)
+// so a move only needs two lookups to update them.
+unsigned long long int zobristPieces[14][64];
+unsigned long long int zobristCastling[16];
+unsigned long long int zobristEpFile[8];
+unsigned long long int zobristSide;
+unsigned long long int zobristPawnBase; // starts every pawn key, so no position has a pawn key of zero
 
-void destroyMoveList(MoveList* ml) {
-    free(ml->moves);
+// xorshift64*, always seeded with fixed values so tables built from it are the same on every run
+unsigned long long int random64(unsigned long long int* state) {
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 2685821657736338717ULL;
 }
 
-void addMove(MoveList *ml, unsigned long long int move) {
-    if (ml->length == ml->capacity) {
-        ml->capacity += 10;
-        unsigned long long int *temp = (unsigned long long int*)realloc(ml->moves, ml->capacity * sizeof(unsigned long long int));
-        if (temp == NULL) {
-            printf("problem while trying to grow a move list\n");
-            free(ml->moves);
-            exit(0);
+void initZobrist() {
+    unsigned long long int rngState = 0x2545F4914F6CDD1DULL;
+    for (int i = 0; i < 14; i++) {
+        for (int j = 0; j < 64; j++) {
+            // Indexes 0 and 7 are the colour bitboards, never hashed
+            zobristPieces[i][j] = (i % 7) ? random64(&rngState) : 0;
         }
-        ml->moves = temp;
     }
-    ml->moves[ml->length] = move;
-    ml->length++;
+    // No rights hashes to zero, so an empty castling state adds nothing to the key
+    zobristCastling[0] = 0;
+    for (int i = 1; i < 16; i++) zobristCastling[i] = random64(&rngState);
+    for (int i = 0; i < 8; i++) zobristEpFile[i] = random64(&rngState);
+    zobristSide = random64(&rngState);
+    zobristPawnBase = random64(&rngState);
 }
 
-void removeLastMove(MoveList* ml) {
-    ml->length--;
+void initUndoStack(UndoStack *us, int capacity) {
+    us->entries = malloc(capacity * sizeof(Undo));
+    us->length = 0;
+    us->capacity = capacity;
 }
 
-// Sets up the chess board to the starting position
-void initBoardState(Board* board, char* pieceSymbols) {
-    board->pieceBB[0] = 0x000000000000FFFFL; // White
-    board->pieceBB[1] = 0x000000000000FF00L; // Pawns
-    board->pieceBB[2] = 0x0000000000000042L; // Knights
-    board->pieceBB[3] = 0x0000000000000024L; // Bishops
-    board->pieceBB[4] = 0x0000000000000081L; // Rooks
-    board->pieceBB[5] = 0x0000000000000010L; // Queens
-    board->pieceBB[6] = 0x0000000000000008L; // Kings
-    board->pieceBB[7] = 0xFFFF000000000000L; // Black
-    board->pieceBB[8] = 0x00FF000000000000L; // Pawns
-    board->pieceBB[9] = 0x4200000000000000L; // Knights
-    board->pieceBB[10] = 0x2400000000000000L; // Bishops
-    board->pieceBB[11] = 0x8100000000000000L; // Rooks
-    board->pieceBB[12] = 0x1000000000000000L; // Queens
-    board->pieceBB[13] = 0x0800000000000000L; // Kings
-    board->emptyBB = 0x0000ffffffff0000ULL;
-    board->occupiedBB = 0xffff00000000ffffULL;
-    board->castlingRights[0] = true; board->castlingRights[1] = true; // K  Q
-    board->castlingRights[2] = true; board->castlingRights[3] = true; // k  q
-    board->epSquare = 0;
+void destroyUndoStack(UndoStack* us) {
+    free(us->entries);
+}
 
-    // This looks rotated, but that is so that the index gotten by bitscanforward on a bitboard to line up correctly,
-    // since 0 there is the bottom right, and zero here is top left
-    int temp[64] = {
-        4, 2, 3, 6, 5, 3, 2, 4,
-        1, 1, 1, 1, 1, 1, 1, 1,
-        0, 0, 0, 0, 0, 0, 0, 0,
-        0, 0, 0, 0, 0, 0, 0, 0,
-        0, 0, 0, 0, 0, 0, 0, 0,
-        0, 0, 0, 0, 0, 0, 0, 0,
-        1, 1, 1, 1, 1, 1, 1, 1,
-        4, 2, 3, 6, 5, 3, 2, 4
-    };
-    memcpy_s(board->boardBySquare, sizeof(board->boardBySquare), temp, 64 * sizeof(int));
-    board->halfMoveClock = 0;
-    board->fullMoveNumber = 1;
-    board->playerToMove = 0;
-    initMoveList(&(board->history), 30);
+// Makes sure count more entries fit, false, leaving the stack as it was, if it had to grow and couldn't
+bool reserveUndo(UndoStack *us, int count) {
+    if (us->length + count <= us->capacity) return true;
+    STAT_INC(undoGrowths);
+    Undo *temp = (Undo*)realloc(us->entries, (us->length + count + 10) * sizeof(Undo));
+    if (temp == NULL) {
+        printf("problem while trying to grow the undo stack\n");
+        return false;
+    }
+    us->entries = temp;
+    us->capacity = us->length + count + 10;
+    return true;
+}
 
-    strcpy_s(pieceSymbols, 15, "_PNBRQK_pnbrqk");
+// The room has to have been made with reserveUndo
+static inline Undo* pushUndo(UndoStack *us) {
+    return &us->entries[us->length++];
 }
 
-// Assumes a properly formed FEN string, sets up board according to the string
-void readFenStringToBoard(char *fenString, Board *board) {
-    int i = 0, squareIndex;
-    unsigned long long int square = 0x8000000000000000ULL;
-    for (i = 0; i < 14; i++) board->pieceBB[i] = 0;
-    board->emptyBB = 0xffffffffffffffffULL;
-    board->occupiedBB = 0x0000000000000000ULL;
-    int temp[64] = {
-        0, 0, 0, 0, 0, 0, 0, 0,
-        0, 0, 0, 0, 0, 0, 0, 0,
-        0, 0, 0, 0, 0, 0, 0, 0,
-        0, 0, 0, 0, 0, 0, 0, 0,
-        0, 0, 0, 0, 0, 0, 0, 0,
-        0, 0, 0, 0, 0, 0, 0, 0,
-        0, 0, 0, 0, 0, 0, 0, 0,
-        0, 0, 0, 0, 0, 0, 0, 0,
-    };
-    memcpy_s(board->boardBySquare, sizeof(board->boardBySquare), temp, 64 * sizeof(int));
-    board->castlingRights[0] = false; board->castlingRights[1] = false; // K  Q
-    board->castlingRights[2] = false; board->castlingRights[3] = false; // k  q
-    board->epSquare = 0;
+static inline void pushMove(MoveBuffer *mb, Move move) {
+    mb->moves[mb->length++] = move;
+}
 
-    destroyMoveList(&(board->history));
-    initMoveList(&(board->history), 30);
-
-    i = 0;
-    while (fenString[i] != ' ') {
-        if (isalpha(fenString[i])) {
-            switch (fenString[i]) {
-            case 'P':
-                board->emptyBB ^= square;
-                board->occupiedBB |= square;
-                board->pieceBB[0] |= square;
-                board->pieceBB[1] |= square;
-                BitScanForward64(&squareIndex, square);
-                board->boardBySquare[squareIndex] = 1;
-                break;
-            case 'N':
-                board->emptyBB ^= square;
-                board->occupiedBB |= square;
-                board->pieceBB[0] |= square;
-                board->pieceBB[2] |= square;
-                BitScanForward64(&squareIndex, square);
-                board->boardBySquare[squareIndex] = 2;
-                break;
-            case 'B':
-                board->emptyBB ^= square;
-                board->occupiedBB |= square;
-                board->pieceBB[0] |= square;
-                board->pieceBB[3] |= square;
-                BitScanForward64(&squareIndex, square);
-                board->boardBySquare[squareIndex] = 3;
-                break;
-            case 'R':
-                board->emptyBB ^= square;
-                board->occupiedBB |= square;
-                board->pieceBB[0] |= square;
-                board->pieceBB[4] |= square;
-                BitScanForward64(&squareIndex, square);
-                board->boardBySquare[squareIndex] = 4;
-                break;
-            case 'Q':
-                board->emptyBB ^= square;
-                board->occupiedBB |= square;
-                board->pieceBB[0] |= square;
-                board->pieceBB[5] |= square;
-                BitScanForward64(&squareIndex, square);
-                board->boardBySquare[squareIndex] = 5;
-                break;
-            case 'K':
-                board->emptyBB ^= square;
-                board->occupiedBB |= square;
-                board->pieceBB[0] |= square;
-                board->pieceBB[6] |= square;
-                BitScanForward64(&squareIndex, square);
-                board->boardBySquare[squareIndex] = 6;
-                break;
-            case 'p':
-                board->emptyBB ^= square;
-                board->occupiedBB |= square;
-                board->pieceBB[7] |= square;
-                board->pieceBB[8] |= square;
-                BitScanForward64(&squareIndex, square);
-                board->boardBySquare[squareIndex] = 1;
-                break;
-            case 'n':
-                board->emptyBB ^= square;
-                board->occupiedBB |= square;
-                board->pieceBB[7] |= square;
-                board->pieceBB[9] |= square;
-                BitScanForward64(&squareIndex, square);
-                board->boardBySquare[squareIndex] = 2;
-                break;
-            case 'b':
-                board->emptyBB ^= square;
-                board->occupiedBB |= square;
-                board->pieceBB[7] |= square;
-                board->pieceBB[10] |= square;
-                BitScanForward64(&squareIndex, square);
-                board->boardBySquare[squareIndex] = 3;
-                break;
-            case 'r':
-                board->emptyBB ^= square;
-                board->occupiedBB |= square;
-                board->pieceBB[7] |= square;
-                board->pieceBB[11] |= square;
-                BitScanForward64(&squareIndex, square);
-                board->boardBySquare[squareIndex] = 4;
-                break;
-            case 'q':
-                board->emptyBB ^= square;
-                board->occupiedBB |= square;
-                board->pieceBB[7] |= square;
-                board->pieceBB[12] |= square;
-                BitScanForward64(&squareIndex, square);
-                board->boardBySquare[squareIndex] = 5;
-                break;
-            case 'k':
-                board->emptyBB ^= square;
-                board->occupiedBB |= square;
-                board->pieceBB[7] |= square;
-                board->pieceBB[13] |= square;
-                BitScanForward64(&squareIndex, square);
-                board->boardBySquare[squareIndex] = 6;
-                break;
-            }
-            square = square >> 1;
-        }
-        else if (isdigit(fenString[i])) {
-            square = square >> (fenString[i] - '0');
-        } // Don't need to do anything with '/'s, square automatically wraps back
-          //when it gets shifted off the right edge of the board.
-        i++;
-    }
+int castlingIndex(Board* board) {
+    return board->castlingRights[0] | (board->castlingRights[1] << 1) | (board->castlingRights[2] << 2) | (board->castlingRights[3] << 3);
+}
 
-    board->playerToMove = fenString[++i] == 'b'; i++;
+int epFile(unsigned long long int epSquare) {
+    return bitScanForward(epSquare) & 7;
+}
 
-    if (fenString[++i] == '-') {
-        i++;
-    }
-    else {
-        while (fenString[i] != ' ') {
-            switch (fenString[i]) {
-            case 'K':
-                board->castlingRights[0] = true;
-                break;
-            case 'Q':
-                board->castlingRights[1] = true;
-                break;
-            case 'k':
-                board->castlingRights[2] = true;
-                break;
-            case 'q':
-                board->castlingRights[3] = true;
-                break;
-            }
-            i++;
-        }
+// Builds the position key from scratch. makeMove and unmakeMove keep it up to date incrementally after this.
+unsigned long long int computeZobristKey(Board* board) {
+    unsigned long long int key = 0, pieces;
+    unsigned long int squareIndex;
+    for (int i = 1; i < 14; i++) {
+        if (i == 7) continue;
+        pieces = board->pieceBB[i];
+        if (pieces) do {
+            squareIndex = bitScanForward(pieces);
+            key ^= zobristPieces[i][squareIndex];
+        } while (pieces &= pieces - 1);
     }
+    key ^= zobristCastling[castlingIndex(board)];
+    if (board->epSquare) key ^= zobristEpFile[epFile(board->epSquare)];
+    if (board->playerToMove) key ^= zobristSide;
+    return key;
+}
 
-    if (fenString[++i] == '-') {
-        i++;
+unsigned long long int computePawnKey(Board* board) {
+    unsigned long long int key = zobristPawnBase, pawns;
+    for (int i = 1; i < 14; i += 7) {
+        pawns = board->pieceBB[i];
+        if (pawns) do {
+            key ^= zobristPieces[i][bitScanForward(pawns)];
+        } while (pawns &= pawns - 1);
     }
-    else {
-        board->epSquare = 1ULL << ('h' - 'a' - fenString[i++] + 1);
-        board->epSquare = board->epSquare << (8 * ('8' - '1' - fenString[i++]));
+    return key;
+}
+
+#ifdef ZOBRIST_DEBUG
+void checkZobristKey(Board* board, char* where) {
+    unsigned long long int expected = computeZobristKey(board);
+    if (board->zobristKey != expected) {
+        printf("zobrist mismatch after %s: incremental %016llx, recomputed %016llx\n", where, board->zobristKey, expected);
     }
-    board->halfMoveClock = fenString[++i] - '0';
-    if (fenString[++i] != ' ') {
-        board->halfMoveClock = board->halfMoveClock * 10 + fenString[i++] - '0';
+    expected = computePawnKey(board);
+    if (board->pawnKey != expected) {
+        printf("pawn key mismatch after %s: incremental %016llx, recomputed %016llx\n", where, board->pawnKey, expected);
     }
+}
+#endif
 
-    board->fullMoveNumber = fenString[++i] - '0';
-    while (isdigit(fenString[++i])) {
-        board->fullMoveNumber = board->fullMoveNumber * 10 + fenString[i++] - '0';
+// Evaluation tables. Piece-square values are written from white's side with a8 first, the way a board is drawn.
+// initEvaluation folds them together with the material values into pieceScores, indexed like pieceBB, with
+// black's entries mirrored and negated so a board's score is just the sum over its pieces.
+int materialMg[7] = { 0, 82, 337, 365, 477, 1025, 0 };
+int materialEg[7] = { 0, 94, 281, 297, 512, 936, 0 };
+// How much each piece counts towards the middlegame, 24 with all of them on the board
+int phaseWeights[7] = { 0, 0, 1, 1, 2, 4, 0 };
+#define MAX_PHASE 24
+
+int pawnSquaresMg[64] = {
+      0,   0,   0,   0,   0,   0,   0,   0,
+     50,  50,  50,  50,  50,  50,  50,  50,
+     10,  10,  20,  30,  30,  20,  10,  10,
+      5,   5,  10,  25,  25,  10,   5,   5,
+      0,   0,   0,  20,  20,   0,   0,   0,
+      5,  -5, -10,   0,   0, -10,  -5,   5,
+      5,  10,  10, -20, -20,  10,  10,   5,
+      0,   0,   0,   0,   0,   0,   0,   0
+};
+int pawnSquaresEg[64] = {
+      0,   0,   0,   0,   0,   0,   0,   0,
+     80,  80,  80,  80,  80,  80,  80,  80,
+     50,  50,  50,  50,  50,  50,  50,  50,
+     30,  30,  30,  30,  30,  30,  30,  30,
+     15,  15,  15,  15,  15,  15,  15,  15,
+      5,   5,   5,   5,   5,   5,   5,   5,
+      0,   0,   0,   0,   0,   0,   0,   0,
+      0,   0,   0,   0,   0,   0,   0,   0
+};
+int knightSquares[64] = {
+    -50, -40, -30, -30, -30, -30, -40, -50,
+    -40, -20,   0,   0,   0,   0, -20, -40,
+    -30,   0,  10,  15,  15,  10,   0, -30,
+    -30,   5,  15,  20,  20,  15,   5, -30,
+    -30,   0,  15,  20,  20,  15,   0, -30,
+    -30,   5,  10,  15,  15,  10,   5, -30,
+    -40, -20,   0,   5,   5,   0, -20, -40,
+    -50, -40, -30, -30, -30, -30, -40, -50
+};
+int bishopSquares[64] = {
+    -20, -10, -10, -10, -10, -10, -10, -20,
+    -10,   0,   0,   0,   0,   0,   0, -10,
+    -10,   0,   5,  10,  10,   5,   0, -10,
+    -10,   5,   5,  10,  10,   5,   5, -10,
+    -10,   0,  10,  10,  10,  10,   0, -10,
+    -10,  10,  10,  10,  10,  10,  10, -10,
+    -10,   5,   0,   0,   0,   0,   5, -10,
+    -20, -10, -10, -10, -10, -10, -10, -20
+};
+int rookSquares[64] = {
+      0,   0,   0,   0,   0,   0,   0,   0,
+      5,  10,  10,  10,  10,  10,  10,   5,
+     -5,   0,   0,   0,   0,   0,   0,  -5,
+     -5,   0,   0,   0,   0,   0,   0,  -5,
+     -5,   0,   0,   0,   0,   0,   0,  -5,
+     -5,   0,   0,   0,   0,   0,   0,  -5,
+     -5,   0,   0,   0,   0,   0,   0,  -5,
+      0,   0,   0,   5,   5,   0,   0,   0
+};
+int queenSquares[64] = {
+    -20, -10, -10,  -5,  -5, -10, -10, -20,
+    -10,   0,   0,   0,   0,   0,   0, -10,
+    -10,   0,   5,   5,   5,   5,   0, -10,
+     -5,   0,   5,   5,   5,   5,   0,  -5,
+      0,   0,   5,   5,   5,   5,   0,  -5,
+    -10,   5,   5,   5,   5,   5,   0, -10,
+    -10,   0,   5,   0,   0,   0,   0, -10,
+    -20, -10, -10,  -5,  -5, -10, -10, -20
+};
+int kingSquaresMg[64] = {
+    -30, -40, -40, -50, -50, -40, -40, -30,
+    -30, -40, -40, -50, -50, -40, -40, -30,
+    -30, -40, -40, -50, -50, -40, -40, -30,
+    -30, -40, -40, -50, -50, -40, -40, -30,
+    -20, -30, -30, -40, -40, -30, -30, -20,
+    -10, -20, -20, -20, -20, -20, -20, -10,
+     20,  20,   0,   0,   0,   0,  20,  20,
+     20,  30,  10,   0,   0,  10,  30,  20
+};
+int kingSquaresEg[64] = {
+    -50, -40, -30, -20, -20, -30, -40, -50,
+    -30, -20, -10,   0,   0, -10, -20, -30,
+    -30, -10,  20,  30,  30,  20, -10, -30,
+    -30, -10,  30,  40,  40,  30, -10, -30,
+    -30, -10,  30,  40,  40,  30, -10, -30,
+    -30, -10,  20,  30,  30,  20, -10, -30,
+    -30, -30,   0,   0,   0,   0, -30, -30,
+    -50, -30, -30, -30, -30, -30, -30, -50
+};
+
+int pieceScoresMg[14][64];
+int pieceScoresEg[14][64];
+
+// Pawn structure masks. Files are numbered like squares, 0 is the h-file.
+unsigned long long int fileMasks[8];
+unsigned long long int adjacentFilesMasks[8];
+unsigned long long int passedPawnMasks[2][64]; // squares ahead on the pawn's own and adjacent files
+unsigned long long int pawnShieldMasks[2][64]; // the two ranks in front of the king, its own and adjacent files
+
+void initEvaluation() {
+    int* tablesMg[7] = { NULL, pawnSquaresMg, knightSquares, bishopSquares, rookSquares, queenSquares, kingSquaresMg };
+    int* tablesEg[7] = { NULL, pawnSquaresEg, knightSquares, bishopSquares, rookSquares, queenSquares, kingSquaresEg };
+    for (int piece = 1; piece <= 6; piece++) {
+        for (int squareIndex = 0; squareIndex < 64; squareIndex++) {
+            // Square 0 is h1, the last entry of a table. Black looks the square up with the ranks flipped.
+            pieceScoresMg[piece][squareIndex] = materialMg[piece] + tablesMg[piece][63 - squareIndex];
+            pieceScoresEg[piece][squareIndex] = materialEg[piece] + tablesEg[piece][63 - squareIndex];
+            pieceScoresMg[piece + 7][squareIndex] = -(materialMg[piece] + tablesMg[piece][63 - (squareIndex ^ 56)]);
+            pieceScoresEg[piece + 7][squareIndex] = -(materialEg[piece] + tablesEg[piece][63 - (squareIndex ^ 56)]);
+        }
     }
-}
 
-void strreverse(char* begin, char* end) {
-    char temp;
-    while (end > begin) {
-        temp = *end, * end-- = *begin, * begin++ = temp;
+    for (int file = 0; file < 8; file++) fileMasks[file] = 0x0101010101010101ULL << file;
+    for (int file = 0; file < 8; file++) {
+        adjacentFilesMasks[file] = ((file > 0) ? fileMasks[file - 1] : 0) | ((file < 7) ? fileMasks[file + 1] : 0);
+    }
+    for (int squareIndex = 0; squareIndex < 64; squareIndex++) {
+        int rank = squareIndex / 8, file = squareIndex % 8;
+        unsigned long long int files = fileMasks[file] | adjacentFilesMasks[file];
+        unsigned long long int above = (rank < 7) ? ~0ULL << (8 * (rank + 1)) : 0;
+        unsigned long long int below = (rank > 0) ? ~0ULL >> (8 * (8 - rank)) : 0;
+        passedPawnMasks[0][squareIndex] = files & above;
+        passedPawnMasks[1][squareIndex] = files & below;
+        pawnShieldMasks[0][squareIndex] = files & above & ((rank < 6) ? ~(~0ULL << (8 * (rank + 3))) : ~0ULL);
+        pawnShieldMasks[1][squareIndex] = files & below & ((rank > 1) ? ~0ULL << (8 * (rank - 2)) : ~0ULL);
     }
 }
 
-void intToString(int value, char* str, int base) {
-    static char num[] = "0123456789abcdefghijklmnopqrstuvwxyz";
-    char* wstr = str;
-    int sign;
-
-    if (base < 2 || base>35) { *wstr = '\0'; return; }
+// Neural network evaluation. 768 inputs, one per colour, piece type and square, seen from each side in turn
+// (own pieces first, board flipped for black), into NNUE_HIDDEN clipped ReLU neurons per side, then one output
+// over both sides' neurons with the side to move's half first. The first layer is the accumulator in Board,
+// which addPieceScore and removePieceScore keep up to date so only the output layer runs per evaluation.
+//
+// File layout, little endian: "MCENNUE1", hidden size (uint32), 4 bytes padding, feature weights
+// (int16 [768][hidden]), feature biases (int16 [hidden]), output weights (int16 [2 * hidden]), output bias (int32).
+#define NNUE_INPUTS 768
+#define NNUE_QA 255 // accumulator scale, and the clipping point
+#define NNUE_QB 64 // output weight scale
+#define NNUE_SCALE 400 // output units to centipawns
 
-    // Take care of sign
-    if ((sign = value) < 0) value = -value;
-
-    // Conversion. Number is reversed.
-    do *wstr++ = num[value % base]; while (value /= base);
+typedef struct {
+    bool isLoaded;
+    const void* mapping;
+    size_t mappingSize;
+    const short* featureWeights;
+    const short* featureBiases;
+    const short* outputWeights;
+    int outputBias;
+} Network;
 
-    if (sign < 0) *wstr++ = '-';
+Network network;
 
-    *wstr = '\0';
+// Kernels over one accumulator row, picked in initNnue for the CPU the engine runs on
+void (*nnueAddRow)(short *accumulator, const short *weights);
+void (*nnueSubRow)(short *accumulator, const short *weights);
+int (*nnueOutput)(const short *us, const short *them, const short *weights);
+const char* nnueKernelName;
 
-    // Reverse string
-    strreverse(str, wstr - 1);
+void addRowScalar(short *accumulator, const short *weights) {
+    for (int i = 0; i < NNUE_HIDDEN; i++) accumulator[i] += weights[i];
 }
 
-char* boardToFEN(Board *board, char *pieceSymbols) {
-    char* fen = (char*)calloc(92, sizeof(char)); // upper bound on fen string length
-    int a = 0, emptyCount = 0;
+void subRowScalar(short *accumulator, const short *weights) {
+    for (int i = 0; i < NNUE_HIDDEN; i++) accumulator[i] -= weights[i];
+}
 
-    // piece placements
-    for (int i = 56, k = 0; i >= 0; i -= 8, k += 8) {
-        for (int j = 7, m = 0; j >= 0; j--, m++) {
-            if ((board->occupiedBB & (1ULL << (i + j))) && emptyCount > 0) {
-                fen[(a++)] = '0' + emptyCount;
-                emptyCount = 0;
-            }
+int outputScalar(const short *us, const short *them, const short *weights) {
+    int sum = 0;
+    for (int i = 0; i < NNUE_HIDDEN; i++) {
+        int a = (us[i] < 0) ? 0 : (us[i] > NNUE_QA) ? NNUE_QA : us[i];
+        int b = (them[i] < 0) ? 0 : (them[i] > NNUE_QA) ? NNUE_QA : them[i];
+        sum += a * weights[i] + b * weights[NNUE_HIDDEN + i];
+    }
+    return sum;
+}
 
-            for (int p = 1; p <= 6; p++) {
-                if ((1ULL << (i + j)) & board->pieceBB[p]) { // white piece
-                    fen[(a++)] = pieceSymbols[p];
-                    break;
-                }
-                else if ((1ULL << (i + j)) & board->pieceBB[p + 7]) { // black piece
-                    fen[(a++)] = pieceSymbols[p + 7];
-                    break;
-                }
-                else if (p == 6) { // empty square. find how many empty squares there are in a row.
-                    emptyCount++;
-                }
-            }
+#if defined(_M_X64) || defined(__x86_64__) || defined(__i386__)
+#ifdef _MSC_VER
+#define TARGET_SSE41
+#define TARGET_AVX2
+#else
+#define TARGET_SSE41 __attribute__((target("sse4.1")))
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#endif
 
-            if (emptyCount > 0 && j == 0) {
-                fen[(a++)] = '0' + emptyCount;
-                emptyCount = 0;
-            }
+TARGET_SSE41 void addRowSse41(short *accumulator, const short *weights) {
+    for (int i = 0; i < NNUE_HIDDEN; i += 8) {
+        __m128i sum = _mm_add_epi16(_mm_loadu_si128((__m128i*)&accumulator[i]), _mm_loadu_si128((__m128i*)&weights[i]));
+        _mm_storeu_si128((__m128i*)&accumulator[i], sum);
+    }
+}
 
-            if (j == 0 && i != 0) fen[(a++)] = '/';
-        }
+TARGET_SSE41 void subRowSse41(short *accumulator, const short *weights) {
+    for (int i = 0; i < NNUE_HIDDEN; i += 8) {
+        __m128i difference = _mm_sub_epi16(_mm_loadu_si128((__m128i*)&accumulator[i]), _mm_loadu_si128((__m128i*)&weights[i]));
+        _mm_storeu_si128((__m128i*)&accumulator[i], difference);
     }
+}
 
-    // playerToMove
-    fen[(a++)] = ' ';
-    if (board->playerToMove) {
-        fen[(a++)] = 'b';
+TARGET_SSE41 int outputSse41(const short *us, const short *them, const short *weights) {
+    __m128i zero = _mm_setzero_si128(), limit = _mm_set1_epi16(NNUE_QA), sum = _mm_setzero_si128();
+    for (int i = 0; i < NNUE_HIDDEN; i += 8) {
+        __m128i a = _mm_min_epi16(_mm_max_epi16(_mm_loadu_si128((__m128i*)&us[i]), zero), limit);
+        __m128i b = _mm_min_epi16(_mm_max_epi16(_mm_loadu_si128((__m128i*)&them[i]), zero), limit);
+        sum = _mm_add_epi32(sum, _mm_madd_epi16(a, _mm_loadu_si128((__m128i*)&weights[i])));
+        sum = _mm_add_epi32(sum, _mm_madd_epi16(b, _mm_loadu_si128((__m128i*)&weights[NNUE_HIDDEN + i])));
     }
-    else fen[(a++)] = 'w';
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 0x4E));
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 0xB1));
+    return _mm_cvtsi128_si32(sum);
+}
 
-    // Castling rights
-    fen[(a++)] = ' ';
-    if (board->castlingRights[0] || board->castlingRights[1] || board->castlingRights[2] || board->castlingRights[3]) {
-        if (board->castlingRights[0]) fen[(a++)] = 'K';
-        if (board->castlingRights[1]) fen[(a++)] = 'Q';
-        if (board->castlingRights[2]) fen[(a++)] = 'k';
-        if (board->castlingRights[3]) fen[(a++)] = 'q';
+TARGET_AVX2 void addRowAvx2(short *accumulator, const short *weights) {
+    for (int i = 0; i < NNUE_HIDDEN; i += 16) {
+        __m256i sum = _mm256_add_epi16(_mm256_loadu_si256((__m256i*)&accumulator[i]), _mm256_loadu_si256((__m256i*)&weights[i]));
+        _mm256_storeu_si256((__m256i*)&accumulator[i], sum);
     }
-    else {
-        fen[(a++)] = '-';
+}
+
+TARGET_AVX2 void subRowAvx2(short *accumulator, const short *weights) {
+    for (int i = 0; i < NNUE_HIDDEN; i += 16) {
+        __m256i difference = _mm256_sub_epi16(_mm256_loadu_si256((__m256i*)&accumulator[i]), _mm256_loadu_si256((__m256i*)&weights[i]));
+        _mm256_storeu_si256((__m256i*)&accumulator[i], difference);
     }
+}
 
-    // en passant square
-    fen[(a++)] = ' ';
-    if (board->epSquare) {
-        int trailingZeros;
-        BitScanForward64(&trailingZeros, board->epSquare);
-        fen[(a++)] = 'h' - (trailingZeros % 8);
-        fen[(a++)] = '1' + (trailingZeros / 8);
+TARGET_AVX2 int outputAvx2(const short *us, const short *them, const short *weights) {
+    __m256i zero = _mm256_setzero_si256(), limit = _mm256_set1_epi16(NNUE_QA), sum = _mm256_setzero_si256();
+    for (int i = 0; i < NNUE_HIDDEN; i += 16) {
+        __m256i a = _mm256_min_epi16(_mm256_max_epi16(_mm256_loadu_si256((__m256i*)&us[i]), zero), limit);
+        __m256i b = _mm256_min_epi16(_mm256_max_epi16(_mm256_loadu_si256((__m256i*)&them[i]), zero), limit);
+        sum = _mm256_add_epi32(sum, _mm256_madd_epi16(a, _mm256_loadu_si256((__m256i*)&weights[i])));
+        sum = _mm256_add_epi32(sum, _mm256_madd_epi16(b, _mm256_loadu_si256((__m256i*)&weights[NNUE_HIDDEN + i])));
     }
-    else fen[(a++)] = '-';
+    __m128i half = _mm_add_epi32(_mm256_castsi256_si128(sum), _mm256_extracti128_si256(sum, 1));
+    half = _mm_add_epi32(half, _mm_shuffle_epi32(half, 0x4E));
+    half = _mm_add_epi32(half, _mm_shuffle_epi32(half, 0xB1));
+    return _mm_cvtsi128_si32(half);
+}
+#endif
 
-    // half move clock
-    fen[(a++)] = ' ';
-    if (board->halfMoveClock <= 9) { // only ever going to be 2 digits long at most
-        fen[(a++)] = '0' + board->halfMoveClock;
+void initNnue() {
+    nnueAddRow = addRowScalar;
+    nnueSubRow = subRowScalar;
+    nnueOutput = outputScalar;
+    nnueKernelName = "scalar";
+#if defined(_M_X64) || defined(__x86_64__) || defined(__i386__)
+    int info[4];
+    cpuid(info, 0, 0);
+    int maxLeaf = info[0];
+    cpuid(info, 1, 0);
+    bool hasSse41 = (info[2] >> 19) & 1;
+    // AVX needs the OS to save the wider registers too, which OSXSAVE and AVX together stand for here
+    bool hasAvx = ((info[2] >> 27) & 1) && ((info[2] >> 28) & 1);
+    bool hasAvx2 = false;
+    if (hasAvx && maxLeaf >= 7) {
+        cpuid(info, 7, 0);
+        hasAvx2 = (info[1] >> 5) & 1;
     }
-    else {
-        fen[(a++)] = '0' + board->halfMoveClock / 10;
-        fen[(a++)] = '0' + board->halfMoveClock % 10;
+    if (hasAvx2) {
+        nnueAddRow = addRowAvx2;
+        nnueSubRow = subRowAvx2;
+        nnueOutput = outputAvx2;
+        nnueKernelName = "avx2";
     }
-
-    // full move number
-    fen[(a++)] = ' ';
-    char buffer[6];
-    intToString(board->fullMoveNumber, buffer, 10);
-    buffer[5] = 0;
-    strcpy_s(&(fen[a]), 5, buffer);
-    return fen;
+    else if (hasSse41) {
+        nnueAddRow = addRowSse41;
+        nnueSubRow = subRowSse41;
+        nnueOutput = outputSse41;
+        nnueKernelName = "sse4.1";
+    }
+#endif
 }
 
-void printBoard(int showFEN, int showBoard, Board *board, char *pieceSymbols) {
-    char* boardString = boardToFEN(board, pieceSymbols);
-    if (showFEN) printf("FEN: %s\n", boardString);
-    if (!showBoard) return;
-
-    int i = 0;
+static inline int nnueFeature(int perspective, int piece, int squareIndex) {
+    int color = piece / 7, type = piece % 7;
+    return ((color != perspective) * 6 + type - 1) * 64 + ((perspective) ? squareIndex ^ 56 : squareIndex);
+}
 
-    printf("To move: %s\n-------------------------------------------------\n", (board->playerToMove)? "black" : "white");
-    for (int j = 0; j < 8; j++) {
-        while (boardString[i] != '/' && boardString[i] != ' ') {
-            if (isalpha(boardString[i])) {
-                printf("|  %c  ", boardString[i]);
-                i++;
-            }
-            else if (boardString[i] == '0') {
-                i++;
-            }
-            else {
-                printf("|     ");
-                boardString[i]--;
-            }
-        }
-        printf("|\n-------------------------------------------------\n");
-        i++;
+// Loads the network, replacing the current one. Returns false, leaving the current one in place, if the file
+// can't be mapped or isn't a network of the size this build was made for.
+bool loadNetwork(const char *path) {
+    size_t size;
+    const unsigned char* data = (const unsigned char*)mapFile(path, &size);
+    if (data == NULL) return false;
+    size_t expected = 16 + sizeof(short) * ((size_t)NNUE_INPUTS * NNUE_HIDDEN + NNUE_HIDDEN + 2 * NNUE_HIDDEN) + sizeof(int);
+    unsigned int hidden;
+    if (size < 16) hidden = 0;
+    else memcpy(&hidden, data + 8, sizeof(hidden));
+    if (size != expected || memcmp(data, "MCENNUE1", 8) || hidden != NNUE_HIDDEN) {
+        unmapFile(data, size);
+        return false;
     }
+    if (network.isLoaded) unmapFile(network.mapping, network.mappingSize);
+    network.mapping = data;
+    network.mappingSize = size;
+    network.featureWeights = (const short*)(data + 16);
+    network.featureBiases = network.featureWeights + (size_t)NNUE_INPUTS * NNUE_HIDDEN;
+    network.outputWeights = network.featureBiases + NNUE_HIDDEN;
+    memcpy(&network.outputBias, network.outputWeights + 2 * NNUE_HIDDEN, sizeof(int));
+    network.isLoaded = true;
+    return true;
+}
 
-    free(boardString);
+void unloadNetwork() {
+    if (network.isLoaded) unmapFile(network.mapping, network.mappingSize);
+    network.isLoaded = false;
 }
 
-void printSquareBasedBoard(Board* board) {
-    for (int i = 7; i >= 0; i--) {
-        for (int j = 7; j >= 0; j--) {
-            printf("%d\t", board->boardBySquare[8 * i + j]);
-        }
-        printf("\n");
+// piece is a pieceBB index. Called wherever a piece lands on or leaves a square in makeMove and unmakeMove.
+static inline void addPieceScore(Board *board, int piece, int squareIndex) {
+    board->scoreMg += pieceScoresMg[piece][squareIndex];
+    board->scoreEg += pieceScoresEg[piece][squareIndex];
+    board->phase += phaseWeights[piece % 7];
+    if (network.isLoaded) {
+        nnueAddRow(board->accumulator[0], network.featureWeights + nnueFeature(0, piece, squareIndex) * NNUE_HIDDEN);
+        nnueAddRow(board->accumulator[1], network.featureWeights + nnueFeature(1, piece, squareIndex) * NNUE_HIDDEN);
     }
-    printf("\n");
 }
 
-/*
-    Move types:
-
-    capture?	Promotion?	Flag1?	Flag2?	Type of move
-    0			0			0		0		quiet
-    0			0			0		1		double pawn push
-    0			0			1		0		king side castle
-    0			0			1		1		queen side castle
-    0			1			0		0		promotion to knight
-    0			1			0		1		promotion to bishop
-    0			1			1		0		promotion to rook
-    0			1			1		1		promotion to queen
-    1			0			0		0		normal capture
-    1			0			0		1		UN-USED
-    1			0			1		0		en-passant capture
-    1			0			1		1		UN-USED
-    1			1			0		0		capture promotion to knight
-    1			1			0		1		capture promotion to bishop
-    1			1			1		0		capture promotion to rook
-    1			1			1		1		capture promotion to queen
-*/
-unsigned long long int formMove(int from, int to,
-    int piece, int cPiece,
-    bool isPromotion,
-    bool f1, bool f2,
-    bool K, bool Q, bool k, bool q,
-    int epSquare, int halfMoveClock) {
-
-    unsigned long long int move = ((from & 0b111111ULL) << 31) |
-        ((to & 0b111111ULL) << 25) |
-        ((piece & 0b111ULL) << 22) |
-        ((cPiece & 0b111ULL) << 19) |
-        ((isPromotion & 0b1ULL) << 18) |
-        ((f1 & 0b1ULL) << 17) |
-        ((f2 & 0b1ULL) << 16) |
-        ((K & 0b1ULL) << 15) |
-        ((Q & 0b1ULL) << 14) |
-        ((k & 0b1ULL) << 13) |
-        ((q & 0b1ULL) << 12) |
-        ((epSquare & 0b111111ULL) << 6) |
-        (halfMoveClock & 0b111111ULL);
-
-    return move;
+static inline void removePieceScore(Board *board, int piece, int squareIndex) {
+    board->scoreMg -= pieceScoresMg[piece][squareIndex];
+    board->scoreEg -= pieceScoresEg[piece][squareIndex];
+    board->phase -= phaseWeights[piece % 7];
+    if (network.isLoaded) {
+        nnueSubRow(board->accumulator[0], network.featureWeights + nnueFeature(0, piece, squareIndex) * NNUE_HIDDEN);
+        nnueSubRow(board->accumulator[1], network.featureWeights + nnueFeature(1, piece, squareIndex) * NNUE_HIDDEN);
+    }
 }
 
-int getFrom(unsigned long long int move) {
-    return (int)((move >> 31) & 0b111111ULL);
-}
-int getTo(unsigned long long int move) {
-    return (int)((move >> 25) & 0b111111ULL);
+// Material and piece-square totals, and the network accumulator, from scratch. They are kept up to date
+// incrementally after this like the key. Has to be called again on every board when a network is loaded.
+void computePieceScores(Board *board) {
+    unsigned long long int pieces;
+    board->scoreMg = 0;
+    board->scoreEg = 0;
+    board->phase = 0;
+    if (network.isLoaded) {
+        memcpy(board->accumulator[0], network.featureBiases, NNUE_HIDDEN * sizeof(short));
+        memcpy(board->accumulator[1], network.featureBiases, NNUE_HIDDEN * sizeof(short));
+    }
+    for (int i = 1; i < 14; i++) {
+        if (i == 7) continue;
+        pieces = board->pieceBB[i];
+        if (pieces) do {
+            addPieceScore(board, i, bitScanForward(pieces));
+        } while (pieces &= pieces - 1);
+    }
 }
-int getPiece(unsigned long long int move) {
-    return (int)((move >> 22) & 0b111ULL);
-}
-int getCPiece(unsigned long long int move) {
-    return (int)((move >> 19) & 0b111ULL);
-}
-bool getIsPromotion(unsigned long long int move) {
-    return (int)((move >> 18) & 0b1ULL);
+
+// Sets up the chess board to the starting position
+void initBoardState(Board* board, char* pieceSymbols) {
+    board->pieceBB[0] = 0x000000000000FFFFL; // White
+    board->pieceBB[1] = 0x000000000000FF00L; // Pawns
+    board->pieceBB[2] = 0x0000000000000042L; // Knights
+    board->pieceBB[3] = 0x0000000000000024L; // Bishops
+    board->pieceBB[4] = 0x0000000000000081L; // Rooks
+    board->pieceBB[5] = 0x0000000000000010L; // Queens
+    board->pieceBB[6] = 0x0000000000000008L; // Kings
+    board->pieceBB[7] = 0xFFFF000000000000L; // Black
+    board->pieceBB[8] = 0x00FF000000000000L; // Pawns
+    board->pieceBB[9] = 0x4200000000000000L; // Knights
+    board->pieceBB[10] = 0x2400000000000000L; // Bishops
+    board->pieceBB[11] = 0x8100000000000000L; // Rooks
+    board->pieceBB[12] = 0x1000000000000000L; // Queens
+    board->pieceBB[13] = 0x0800000000000000L; // Kings
+    board->emptyBB = 0x0000ffffffff0000ULL;
+    board->occupiedBB = 0xffff00000000ffffULL;
+    board->castlingRights[0] = true; board->castlingRights[1] = true; // K  Q
+    board->castlingRights[2] = true; board->castlingRights[3] = true; // k  q
+    board->epSquare = 0;
+
+    // This looks rotated, but that is so that the index gotten by bitscanforward on a bitboard to line up correctly,
+    // since 0 there is the bottom right, and zero here is top left
+    int temp[64] = {
+        4, 2, 3, 6, 5, 3, 2, 4,
+        1, 1, 1, 1, 1, 1, 1, 1,
+        0, 0, 0, 0, 0, 0, 0, 0,
+        0, 0, 0, 0, 0, 0, 0, 0,
+        0, 0, 0, 0, 0, 0, 0, 0,
+        0, 0, 0, 0, 0, 0, 0, 0,
+        1, 1, 1, 1, 1, 1, 1, 1,
+        4, 2, 3, 6, 5, 3, 2, 4
+    };
+    memcpy(board->boardBySquare, temp, sizeof(board->boardBySquare));
+    board->halfMoveClock = 0;
+    board->fullMoveNumber = 1;
+    board->playerToMove = 0;
+    initUndoStack(&(board->history), MAX_PLY + 30);
+    board->zobristKey = computeZobristKey(board);
+    board->pawnKey = computePawnKey(board);
+    computePieceScores(board);
+
+    strcpy(pieceSymbols, "_PNBRQK_pnbrqk");
 }
-bool getF1(unsigned long long int move) {
-    return (int)((move >> 17) & 0b1ULL);
+
+#define START_FEN "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1"
+
+void printSquareBasedBoard(Board* board) {
+    for (int i = 7; i >= 0; i--) {
+        for (int j = 7; j >= 0; j--) {
+            printf("%d\t", board->boardBySquare[8 * i + j]);
+        }
+        printf("\n");
+    }
+    printf("\n");
 }
-bool getF2(unsigned long long int move) {
-    return (int)((move >> 16) & 0b1ULL);
+
+/*
+    Move types:
+
+    capture?	Promotion?	Flag1?	Flag2?	Type of move
+    0			0			0		0		quiet
+    0			0			0		1		double pawn push
+    0			0			1		0		king side castle
+    0			0			1		1		queen side castle
+    0			1			0		0		promotion to knight
+    0			1			0		1		promotion to bishop
+    0			1			1		0		promotion to rook
+    0			1			1		1		promotion to queen
+    1			0			0		0		normal capture
+    1			0			0		1		UN-USED
+    1			0			1		0		en-passant capture
+    1			0			1		1		UN-USED
+    1			1			0		0		capture promotion to knight
+    1			1			0		1		capture promotion to bishop
+    1			1			1		0		capture promotion to rook
+    1			1			1		1		capture promotion to queen
+*/
+static inline Move formMove(int from, int to, bool isCapture, bool isPromotion, bool f1, bool f2) {
+    return (Move)((from << 10) | (to << 4) | (isCapture << 3) | (isPromotion << 2) | (f1 << 1) | f2);
 }
-bool getK(unsigned long long int move) {
-    return (int)((move >> 15) & 0b1ULL);
+
+static inline int getFrom(Move move) {
+    return move >> 10;
 }
-bool getQ(unsigned long long int move) {
-    return (int)((move >> 14) & 0b1ULL);
+static inline int getTo(Move move) {
+    return (move >> 4) & 0b111111;
 }
-bool getk(unsigned long long int move) {
-    return (int)((move >> 13) & 0b1ULL);
+static inline bool getIsCapture(Move move) {
+    return (move >> 3) & 1;
 }
-bool getq(unsigned long long int move) {
-    return (int)((move >> 12) & 0b1ULL);
+static inline bool getIsPromotion(Move move) {
+    return (move >> 2) & 1;
 }
-int getEpSquare(unsigned long long int move) {
-    return (int)((move >> 6) & 0b111111ULL);
+static inline bool getF1(Move move) {
+    return (move >> 1) & 1;
 }
-int getHalfMoveClock(unsigned long long int move) {
-    return (int)(move & 0b111111ULL);
+static inline bool getF2(Move move) {
+    return move & 1;
 }
 
 // Takes move inf the form fftt (e.g. e2e4) and the board it is played on, turns it into a move
-unsigned long long int textToMove(char *moveText, Board *board) {
+Move textToMove(char *moveText, Board *board) {
     int from = 8 * (moveText[1] - '1') + ('h' - moveText[0]);
     int to = 8 * (moveText[3] - '1') + ('h' - moveText[2]);
-    unsigned long long int fromSquare = 1ULL << from;
     unsigned long long int toSquare = 1ULL << to;
 
     int piece = board->boardBySquare[from];
     
-    bool isEpCapture = false;
-    unsigned long long int cPiece = board->pieceBB[(1 - board->playerToMove) * 7] & toSquare;
-    if (cPiece) {
-        cPiece = board->boardBySquare[to];
-    }
-    else if (piece == 1 && to == board->epSquare) { // Look for ep capture
-        isEpCapture = true;
-        cPiece = 1;
-    }
+    bool isEpCapture = piece == 1 && toSquare == board->epSquare;
+    bool isCapture = (board->pieceBB[(1 - board->playerToMove) * 7] & toSquare) || isEpCapture;
 
     bool isDoublePush = (piece == 1 && (from - to == 16 || to - from == 16));
 
@@ -548,9 +1098,9 @@ unsigned long long int textToMove(char *moveText, Board *board) {
 
     bool f1 = false, f2 = false;
     if (isPromotion) {
-        char buffer[2] = { '\0' };
+        char buffer[8] = { '\0' };
         printf("Which promotion?\nQueen = q, Rook = r, Bishop = b, Knight = n, otherwise defaults to queen\n> ");
-        gets_s(buffer, sizeof(buffer));
+        readLine(buffer, sizeof(buffer));
         switch (buffer[0]) {
             default:
             case 'q':
@@ -583,33 +1133,51 @@ unsigned long long int textToMove(char *moveText, Board *board) {
         f2 = true;
     }
 
-    int temp;
-    BitScanForward64(&temp, board->epSquare);
-    return formMove(from, to, piece, cPiece, isPromotion, f1, f2, 
-        board->castlingRights[0], board->castlingRights[1], board->castlingRights[2], 
-        board->castlingRights[3], temp, board->halfMoveClock);
+    return formMove(from, to, isCapture, isPromotion, f1, f2);
 }
 
-void moveToText(char *moveText, unsigned long long int move) {
+// Writes the move as ffttp (e.g. e7e8q), with the promotion piece only for promotions. Needs room for 6 chars.
+void moveToText(char *moveText, Move move) {
     char rank[8] = {'h', 'g', 'f', 'e', 'd', 'c', 'b', 'a'};
     char file[8] = {'1', '2', '3', '4', '5', '6', '7', '8'};
+    char promotion[4] = {'n', 'b', 'r', 'q'};
     int from = getFrom(move);
     int to = getTo(move);
     moveText[0] = rank[from % 8];
     moveText[1] = file[from / 8];
     moveText[2] = rank[to % 8];
     moveText[3] = file[to / 8];
+    moveText[4] = (getIsPromotion(move)) ? promotion[(getF1(move) << 1) | getF2(move)] : '\0';
+    moveText[5] = '\0';
 }
 
-void makeMove(Board *board, unsigned long long int move) {
+void makeMove(Board *board, Move move) {
+    STAT_TIMER_START(timer);
+    STAT_INC(nodes);
     int fromIndex = getFrom(move);
     int toIndex = getTo(move);
     unsigned long long int from = 1ULL << fromIndex;
     unsigned long long int to = 1ULL << toIndex;
-    int piece = getPiece(move);
-    int cPiece = getCPiece(move);
+    int piece = board->boardBySquare[fromIndex];
+    int cPiece = (!getIsCapture(move)) ? 0 : (!getIsPromotion(move) && getF1(move)) ? 1 : board->boardBySquare[toIndex];
     int color = board->playerToMove;
     int color7 = color * 7;
+    int oldCastlingRights = castlingIndex(board);
+
+    // Save what the move can't give back by itself. Game history and undo both come off this stack.
+    Undo* undo = pushUndo(&(board->history));
+    undo->move = move;
+    undo->cPiece = cPiece;
+    undo->castlingRights = oldCastlingRights;
+    int epSquareIndex = 0;
+    if (board->epSquare) epSquareIndex = bitScanForward(board->epSquare);
+    undo->epSquareIndex = epSquareIndex;
+    undo->halfMoveClock = board->halfMoveClock;
+    undo->zobristKey = board->zobristKey;
+
+    // Take the old castling rights and ep square out of the key, the new ones are put back in at the end
+    board->zobristKey ^= zobristCastling[oldCastlingRights];
+    if (board->epSquare) board->zobristKey ^= zobristEpFile[epFile(board->epSquare)];
 
     // Update castling rights
     if (to == 0x0000000000000001ULL || from == 0x0000000000000001ULL) board->castlingRights[0] = false;
@@ -678,9 +1246,19 @@ void makeMove(Board *board, unsigned long long int move) {
                 board->boardBySquare[59] = 0;
             }
         }
+        board->zobristKey ^= zobristPieces[color7 + 6][fromIndex] ^ zobristPieces[color7 + 6][toIndex]
+            ^ zobristPieces[color7 + 4][(getF2(move)) ? fromIndex + 4 : fromIndex - 3]
+            ^ zobristPieces[color7 + 4][(getF2(move)) ? fromIndex + 1 : fromIndex - 1];
+        removePieceScore(board, color7 + 6, fromIndex);
+        addPieceScore(board, color7 + 6, toIndex);
+        removePieceScore(board, color7 + 4, (getF2(move)) ? fromIndex + 4 : fromIndex - 3);
+        addPieceScore(board, color7 + 4, (getF2(move)) ? fromIndex + 1 : fromIndex - 1);
     }
     else {
         // Remove piece at from
+        board->zobristKey ^= zobristPieces[color7 + piece][fromIndex];
+        if (piece == 1) board->pawnKey ^= zobristPieces[color7 + 1][fromIndex];
+        removePieceScore(board, color7 + piece, fromIndex);
         board->pieceBB[color7 + piece] &= ~from;
         board->pieceBB[color7] &= ~from;
         board->occupiedBB &= ~from;
@@ -698,8 +1276,14 @@ void makeMove(Board *board, unsigned long long int move) {
             board->emptyBB |= temp;
 
             board->boardBySquare[(color) ? toIndex + 8 : toIndex - 8] = 0;
+            board->zobristKey ^= zobristPieces[7 - color7 + cPiece][(color) ? toIndex + 8 : toIndex - 8];
+            board->pawnKey ^= zobristPieces[7 - color7 + cPiece][(color) ? toIndex + 8 : toIndex - 8];
+            removePieceScore(board, 7 - color7 + cPiece, (color) ? toIndex + 8 : toIndex - 8);
         }
         else if (cPiece) {
+            board->zobristKey ^= zobristPieces[7 - color7 + cPiece][toIndex];
+            if (cPiece == 1) board->pawnKey ^= zobristPieces[7 - color7 + 1][toIndex];
+            removePieceScore(board, 7 - color7 + cPiece, toIndex);
             board->pieceBB[7 - color7 + cPiece] &= ~to;
             board->pieceBB[7 - color7] &= ~to;
             board->occupiedBB &= ~to;
@@ -727,6 +1311,9 @@ void makeMove(Board *board, unsigned long long int move) {
                 }
             }
         }
+        board->zobristKey ^= zobristPieces[color7 + piece][toIndex];
+        if (piece == 1) board->pawnKey ^= zobristPieces[color7 + 1][toIndex];
+        addPieceScore(board, color7 + piece, toIndex);
         board->pieceBB[color7 + piece] |= to;
         board->pieceBB[color7] |= to;
         board->occupiedBB |= to;
@@ -738,42 +1325,44 @@ void makeMove(Board *board, unsigned long long int move) {
     // Update player to move, ep, and clocks
     board->fullMoveNumber += color;
     board->playerToMove = !board->playerToMove;
-    board->epSquare = (!getIsPromotion(move) && !getF1(move) && getF2(move)) ? (board->epSquare = (color) ? (to << 8) : (to >> 8)) : 0;
-    if (cPiece || piece == 1 || 
-        board->castlingRights[0] != getK(move) || 
-        board->castlingRights[1] != getQ(move) || 
-        board->castlingRights[2] != getk(move) || 
-        board->castlingRights[3] != getq(move))
-    {
+    board->epSquare = (!getIsPromotion(move) && !getF1(move) && getF2(move)) ? ((color) ? (to << 8) : (to >> 8)) : 0;
+    if (cPiece || piece == 1 || castlingIndex(board) != oldCastlingRights) {
         board->halfMoveClock = 0;
     }
     else {
         board->halfMoveClock++;
     }
-
-    // Add to history of moves. Record the game to be able to undo, and just keep track of how the game went.
-    addMove(&(board->history), move);
+    board->zobristKey ^= zobristCastling[castlingIndex(board)] ^ zobristSide;
+    if (board->epSquare) board->zobristKey ^= zobristEpFile[epFile(board->epSquare)];
+    STAT_TIMER_STOP(makeCycles, timer);
+#ifdef ZOBRIST_DEBUG
+    checkZobristKey(board, "makeMove");
+#endif
 }
 
-void unmakeMove(Board *board, unsigned long long int move) {
+// move has to be the last move made on the board
+void unmakeMove(Board *board, Move move) {
+    STAT_TIMER_START(timer);
     int fromIndex = getFrom(move);
     int toIndex = getTo(move);
     unsigned long long int from = 1ULL << fromIndex;
     unsigned long long int to = 1ULL << toIndex;
-    int piece = getPiece(move);
-    int cPiece = getCPiece(move);
+    int piece = board->boardBySquare[toIndex];
     board->playerToMove = !board->playerToMove;
     board->fullMoveNumber -= board->playerToMove;
     int color = board->playerToMove; // color from perspective of the player who made the move
     int color7 = color * 7;
 
-    // Recover history information from the move to restore otherwise irreversible changes
-    board->epSquare = (getEpSquare(move)) ? (1ULL << getEpSquare(move)) : 0;
-    board->halfMoveClock = getHalfMoveClock(move);
-    board->castlingRights[0] = getK(move);
-    board->castlingRights[1] = getQ(move);
-    board->castlingRights[2] = getk(move);
-    board->castlingRights[3] = getq(move);
+    // Recover the irreversible state from the undo stack, the key included, so it needs no updating below
+    Undo* undo = &board->history.entries[--board->history.length];
+    int cPiece = undo->cPiece;
+    board->epSquare = (undo->epSquareIndex) ? (1ULL << undo->epSquareIndex) : 0;
+    board->halfMoveClock = undo->halfMoveClock;
+    board->castlingRights[0] = undo->castlingRights & 1;
+    board->castlingRights[1] = (undo->castlingRights >> 1) & 1;
+    board->castlingRights[2] = (undo->castlingRights >> 2) & 1;
+    board->castlingRights[3] = (undo->castlingRights >> 3) & 1;
+    board->zobristKey = undo->zobristKey;
 
     // Normally reversible parts of moves
     if (!cPiece && !getIsPromotion(move) && getF1(move)) { // Castling is special
@@ -833,9 +1422,15 @@ void unmakeMove(Board *board, unsigned long long int move) {
                 board->boardBySquare[59] = 6;
             }
         }
+        removePieceScore(board, color7 + 6, toIndex);
+        addPieceScore(board, color7 + 6, fromIndex);
+        removePieceScore(board, color7 + 4, (getF2(move)) ? fromIndex + 1 : fromIndex - 1);
+        addPieceScore(board, color7 + 4, (getF2(move)) ? fromIndex + 4 : fromIndex - 3);
     }
     else {
-        // Remove peice at to
+        // Remove peice at to, which is the promoted piece rather than the pawn for promotions
+        removePieceScore(board, color7 + piece, toIndex);
+        if (piece == 1) board->pawnKey ^= zobristPieces[color7 + 1][toIndex];
         board->pieceBB[color7 + piece] &= ~to;
         board->pieceBB[color7] &= ~to;
         board->occupiedBB &= ~to;
@@ -852,8 +1447,12 @@ void unmakeMove(Board *board, unsigned long long int move) {
             board->emptyBB &= ~temp;
 
             board->boardBySquare[(color) ? (toIndex + 8) : (toIndex - 8)] = cPiece;
+            addPieceScore(board, 7 - color7 + cPiece, (color) ? (toIndex + 8) : (toIndex - 8));
+            board->pawnKey ^= zobristPieces[7 - color7 + cPiece][(color) ? (toIndex + 8) : (toIndex - 8)];
         }
         else if (cPiece) {
+            addPieceScore(board, 7 - color7 + cPiece, toIndex);
+            if (cPiece == 1) board->pawnKey ^= zobristPieces[7 - color7 + 1][toIndex];
             board->pieceBB[7 - color7 + cPiece] |= to;
             board->pieceBB[7 - color7] |= to;
             board->occupiedBB |= to;
@@ -864,6 +1463,8 @@ void unmakeMove(Board *board, unsigned long long int move) {
 
         // replace piece at from / exeption for promotion
         piece = (getIsPromotion(move)) ? 1 : piece;
+        addPieceScore(board, color7 + piece, fromIndex);
+        if (piece == 1) board->pawnKey ^= zobristPieces[color7 + 1][fromIndex];
         board->pieceBB[color7 + piece] |= from;
         board->pieceBB[color7] |= from;
         board->occupiedBB |= from;
@@ -871,21 +1472,15 @@ void unmakeMove(Board *board, unsigned long long int move) {
 
         board->boardBySquare[fromIndex] = piece;
     }
-
-    // remove the move being unmade from the history record
-    removeLastMove(&(board->history));
+    STAT_TIMER_STOP(unmakeCycles, timer);
+#ifdef ZOBRIST_DEBUG
+    checkZobristKey(board, "unmakeMove");
+#endif
 }
 
 void unmakeLastMove(Board *board) {
-    unmakeMove(board, board->history.moves[board->history.length - 1]);
-}
-
-void removeOrPlacePiece(Board *board, unsigned long long int square, int piece, int color) {
-    int color7 = color * 7;
-    board->pieceBB[color7 + piece] ^= square;
-    board->pieceBB[color7] ^= square;
-    board->occupiedBB ^= square;
-    board->emptyBB ^= square;
+    if (board->history.length == 0) return;
+    unmakeMove(board, board->history.entries[board->history.length - 1].move);
 }
 
 // Generate rays from squares to blockers / edge of board in specific directions, including blocker but not origin square
@@ -955,8 +1550,133 @@ unsigned long long int dr(unsigned long long int square, unsigned long long int
     return downRight;
 }
 
+// Sliding piece attack tables. Each square gets a mask of the squares whose occupancy can block it (edges excluded),
+// and the occupancy under that mask is turned into an index into a shared table of precomputed attack sets.
+// The index comes from PEXT on cpus that have BMI2, otherwise from a magic multiply and shift.
+typedef struct {
+    unsigned long long int mask;
+    unsigned long long int magic;
+    unsigned long long int* attacks;
+    int shift;
+} Magic;
+
+Magic bishopMagics[64];
+Magic rookMagics[64];
+unsigned long long int bishopTable[5248];
+unsigned long long int rookTable[102400];
+bool usePext = false;
+
+// Squares strictly between two squares on the same rank, file or diagonal, and the whole line through them.
+// Both are empty for squares that don't share a line.
+unsigned long long int betweenBB[64][64];
+unsigned long long int lineBB[64][64];
+
+static inline unsigned int magicIndex(Magic* m, unsigned long long int occupied) {
+    if (usePext) return (unsigned int)pext(occupied, m->mask);
+    return (unsigned int)(((occupied & m->mask) * m->magic) >> m->shift);
+}
+
+static inline unsigned long long int bishopAttacks(int squareIndex, unsigned long long int occupied) {
+    Magic* m = &bishopMagics[squareIndex];
+    return m->attacks[magicIndex(m, occupied)];
+}
+
+static inline unsigned long long int rookAttacks(int squareIndex, unsigned long long int occupied) {
+    Magic* m = &rookMagics[squareIndex];
+    return m->attacks[magicIndex(m, occupied)];
+}
+
+// Slow attack generation with the ray functions, only used to fill the tables at startup
+unsigned long long int slowSliderAttacks(int squareIndex, unsigned long long int occupied, bool isRook) {
+    unsigned long long int square = 1ULL << squareIndex;
+    if (isRook) return u(square, ~occupied) | r(square, ~occupied) | d(square, ~occupied) | l(square, ~occupied);
+    return ul(square, ~occupied) | ur(square, ~occupied) | dl(square, ~occupied) | dr(square, ~occupied);
+}
+
+bool cpuHasBmi2() {
+    int info[4];
+    cpuid(info, 0, 0);
+    if (info[0] < 7) return false;
+    cpuid(info, 7, 0);
+    return (info[1] >> 8) & 1;
+}
+
+void initMagics(Magic* magics, unsigned long long int* table, bool isRook) {
+    // Seeds per rank picked so the search below finishes quickly, any seed works given enough tries
+    int seeds[8] = { 176, 225, 219, 196, 133, 194, 44, 225 };
+    unsigned long long int rngState = 0;
+    // 4096 is the most occupancies any square has (rook in a corner)
+    static unsigned long long int occupancy[4096], reference[4096];
+    static int epoch[4096];
+    int currentEpoch = 0, size = 0;
+    unsigned long long int edges, b;
+
+    for (int squareIndex = 0; squareIndex < 64; squareIndex++) {
+        Magic* m = &magics[squareIndex];
+        if ((squareIndex & 7) == 0) rngState = seeds[squareIndex >> 3] * 0x9E3779B97F4A7C15ULL;
+        // Edge squares never block anything, unless the piece is on that edge
+        edges = ((0x00000000000000FFULL | 0xFF00000000000000ULL) & ~(0x00000000000000FFULL << (8 * (squareIndex >> 3))))
+            | ((0x0101010101010101ULL | 0x8080808080808080ULL) & ~(0x0101010101010101ULL << (squareIndex & 7)));
+        m->mask = slowSliderAttacks(squareIndex, 0, isRook) & ~edges;
+        m->shift = 64 - popCount(m->mask);
+        m->attacks = (squareIndex == 0) ? table : magics[squareIndex - 1].attacks + size;
+
+        // Carry-Rippler trick to walk through every subset of the mask
+        b = 0; size = 0;
+        do {
+            occupancy[size] = b;
+            reference[size] = slowSliderAttacks(squareIndex, b, isRook);
+            if (usePext) m->attacks[pext(b, m->mask)] = reference[size];
+            size++;
+            b = (b - m->mask) & m->mask;
+        } while (b);
+
+        if (usePext) continue;
+
+        // Look for a magic that maps every occupancy to a slot without a destructive collision
+        for (int i = 0; i < size; ) {
+            do {
+                m->magic = random64(&rngState) & random64(&rngState) & random64(&rngState);
+            } while (popCount((m->magic * m->mask) >> 56) < 6);
+
+            currentEpoch++;
+            for (i = 0; i < size; i++) {
+                unsigned int index = magicIndex(m, occupancy[i]);
+                if (epoch[index] < currentEpoch) {
+                    epoch[index] = currentEpoch;
+                    m->attacks[index] = reference[i];
+                }
+                else if (m->attacks[index] != reference[i]) break;
+            }
+        }
+    }
+}
+
+void initSliderAttacks() {
+    usePext = HAVE_PEXT && cpuHasBmi2();
+    initMagics(bishopMagics, bishopTable, false);
+    initMagics(rookMagics, rookTable, true);
+
+    for (int a = 0; a < 64; a++) {
+        for (int b = 0; b < 64; b++) {
+            betweenBB[a][b] = 0;
+            lineBB[a][b] = 0;
+            if (a == b) continue;
+            if (rookAttacks(a, 0) & (1ULL << b)) {
+                betweenBB[a][b] = rookAttacks(a, 1ULL << b) & rookAttacks(b, 1ULL << a);
+                lineBB[a][b] = (rookAttacks(a, 0) & rookAttacks(b, 0)) | (1ULL << a) | (1ULL << b);
+            }
+            else if (bishopAttacks(a, 0) & (1ULL << b)) {
+                betweenBB[a][b] = bishopAttacks(a, 1ULL << b) & bishopAttacks(b, 1ULL << a);
+                lineBB[a][b] = (bishopAttacks(a, 0) & bishopAttacks(b, 0)) | (1ULL << a) | (1ULL << b);
+            }
+        }
+    }
+}
+
 unsigned long long int squaresSeen(unsigned long long int empty, unsigned long long int square, unsigned long long int piece, int color) {
     unsigned long long int seen = 0;
+    unsigned long int squareIndex;
 
     switch (piece) {
     case 1:
@@ -981,76 +1701,63 @@ unsigned long long int squaresSeen(unsigned long long int empty, unsigned long l
         seen |= (square >> 17) & notAFile;
         break;
     case 3:
-        seen |= ul(square, empty);
-        seen |= ur(square, empty);
-        seen |= dl(square, empty);
-        seen |= dr(square, empty);
+        if (square) do {
+            squareIndex = bitScanForward(square);
+            seen |= bishopAttacks(squareIndex, ~empty);
+        } while (square &= square - 1);
         break;
     case 4:
-        seen |= u(square, empty);
-        seen |= r(square, empty);
-        seen |= d(square, empty);
-        seen |= l(square, empty);
+        if (square) do {
+            squareIndex = bitScanForward(square);
+            seen |= rookAttacks(squareIndex, ~empty);
+        } while (square &= square - 1);
         break;
     case 5:
-        seen |= ul(square, empty);
-        seen |= ur(square, empty);
-        seen |= dl(square, empty);
-        seen |= dr(square, empty);
-        seen |= u(square, empty);
-        seen |= r(square, empty);
-        seen |= d(square, empty);
-        seen |= l(square, empty);
+        if (square) do {
+            squareIndex = bitScanForward(square);
+            seen |= bishopAttacks(squareIndex, ~empty) | rookAttacks(squareIndex, ~empty);
+        } while (square &= square - 1);
         break;
     }
     return seen;
 }
 
-// Pupulates the given empty bitboards with the correct masks
-void makePushAndCaptureMask(Board *board, unsigned long long int *pushCapMask) {
+// Enemy pieces giving check to the player to move
+unsigned long long int checkers(Board *board) {
+    STAT_INC(checkersCalls);
     int opp = 7 * !board->playerToMove;
-    int king = board->playerToMove * 7 + 6;
-    unsigned long long int attackingKing;
+    unsigned long long int king = board->pieceBB[board->playerToMove * 7 + 6];
+    unsigned long int kingSquareIndex;
+    kingSquareIndex = bitScanForward(king);
+    return (squaresSeen(board->emptyBB, king, 1, board->playerToMove) & board->pieceBB[opp + 1])
+        | (squaresSeen(board->emptyBB, king, 2, board->playerToMove) & board->pieceBB[opp + 2])
+        | (bishopAttacks(kingSquareIndex, board->occupiedBB) & (board->pieceBB[opp + 3] | board->pieceBB[opp + 5]))
+        | (rookAttacks(kingSquareIndex, board->occupiedBB) & (board->pieceBB[opp + 4] | board->pieceBB[opp + 5]));
+}
 
-    attackingKing  = squaresSeen(board->emptyBB, board->pieceBB[king], 1, board->playerToMove) & board->pieceBB[opp + 1];
-    attackingKing |= squaresSeen(board->emptyBB, board->pieceBB[king], 2, board->playerToMove) & board->pieceBB[opp + 2];
-    attackingKing |= squaresSeen(board->emptyBB, board->pieceBB[king], 3, board->playerToMove) & (board->pieceBB[opp + 3] | board->pieceBB[opp + 5]);
-    attackingKing |= squaresSeen(board->emptyBB, board->pieceBB[king], 4, board->playerToMove) & (board->pieceBB[opp + 4] | board->pieceBB[opp + 5]);
+// Pupulates the given empty bitboards with the correct masks
+// Not in check, every square. In check from one piece, capturing the checker or blocking the line from it to the king.
+// In double check nothing, only the king can move.
+void makePushAndCaptureMask(Board *board, unsigned long long int *pushCapMask) {
+    unsigned long long int attackingKing = checkers(board);
+    unsigned long int tzcKing, tzcAttacker;
 
-    int count = __popcnt64(attackingKing);
+    int count = popCount(attackingKing);
     if (!count) {
         *pushCapMask = 0xFFFFFFFFFFFFFFFFULL;
         return;
     }
     if (count == 1) {
-        *pushCapMask = attackingKing;
-        unsigned long int tzcKing, tzcAttacker, temp;
-        unsigned int rk, fk, ra, fa;
-        bool reverse = false;
-        BitScanForward64(&tzcKing, board->pieceBB[king]);
-        BitScanForward64(&tzcAttacker, attackingKing);
-        if (tzcKing > tzcAttacker) reverse = true;
-        rk = tzcKing >> 3;
-        fk = tzcKing & 7;
-        ra = tzcAttacker >> 3;
-        fa = tzcAttacker & 7;
-        if (rk + fk == ra + fa) {
-            *pushCapMask |= ur((reverse) ? attackingKing : board->pieceBB[king], board->emptyBB);
-        }
-        else if (rk - fk == ra - fa) {
-            *pushCapMask |= ul((reverse) ? attackingKing : board->pieceBB[king], board->emptyBB);
-        }
-        else if (rk == ra) {
-            *pushCapMask |= l((reverse) ? attackingKing : board->pieceBB[king], board->emptyBB);
-        }
-        else if (fk == fa) {
-            *pushCapMask |= u((reverse) ? attackingKing : board->pieceBB[king], board->emptyBB);
-        }
+        tzcKing = bitScanForward(board->pieceBB[board->playerToMove * 7 + 6]);
+        tzcAttacker = bitScanForward(attackingKing);
+        *pushCapMask = attackingKing | betweenBB[tzcKing][tzcAttacker];
+        return;
     }
+    *pushCapMask = 0;
 }
 
 bool inCheck(Board *board, int color) {
-    unsigned long long int opponentAttacks = 0;
+    STAT_INC(inCheckCalls);
     int king = color * 7 + 6, opp = (1 - color) * 7;
     unsigned long long int bAndQ = board->pieceBB[opp + 3] | board->pieceBB[opp + 5];
     unsigned long long int rAndQ = board->pieceBB[opp + 4] | board->pieceBB[opp + 5];
@@ -1066,451 +1773,3126 @@ bool inCheck(Board *board, int color) {
     return (unsafeSquares & board->pieceBB[king]) != 0;
 }
 
-// Legal moves only are added to move list
-void generateMoves(MoveList *ml, Board *board) {
+unsigned long long int kingAttacks(unsigned long long int king) {
+    unsigned long long int attacks = ((king << 1) & notHFile) | ((king >> 1) & notAFile);
+    return attacks | ((attacks | king) << 8) | ((attacks | king) >> 8);
+}
+
+// Squares the king of the player to move can't go to. The king is taken off the board first so it
+// can't hide from a slider behind itself.
+unsigned long long int kingDangerSquares(Board *board) {
+    int opp = 7 * !board->playerToMove;
+    unsigned long long int emptyKingRemoved = board->emptyBB ^ board->pieceBB[board->playerToMove * 7 + 6];
+    unsigned long long int unsafeSquares;
+    unsafeSquares  = squaresSeen(emptyKingRemoved, board->pieceBB[opp + 1], 1, opp);
+    unsafeSquares |= squaresSeen(emptyKingRemoved, board->pieceBB[opp + 2], 2, opp);
+    unsafeSquares |= squaresSeen(emptyKingRemoved, board->pieceBB[opp + 3] | board->pieceBB[opp + 5], 3, opp);
+    unsafeSquares |= squaresSeen(emptyKingRemoved, board->pieceBB[opp + 4] | board->pieceBB[opp + 5], 4, opp);
+    unsafeSquares |= kingAttacks(board->pieceBB[opp + 6]);
+    return unsafeSquares;
+}
+
+// Non-castling king moves, to squares that are safe and not occupied by ones own pieces
+unsigned long long int kingTargets(Board *board, unsigned long long int unsafeSquares) {
+    int self = board->playerToMove * 7;
+    return ~board->pieceBB[self] & ~unsafeSquares & kingAttacks(board->pieceBB[self + 6]);
+}
+
+// Bitboard of pinned pieces for player to move
+// Every enemy slider that would see the king on an empty board is a possible pinner. If exactly one piece stands
+// between the two and it is ours, it is pinned. A pinned piece can only move along the line through it and the
+// king, which is lineBB[king][piece], so nothing about the pinner has to be kept.
+unsigned long long int findPinned(Board *board) {
+    int self = board->playerToMove * 7, opp = 7 - self;
+    unsigned long int kingSquareIndex, sniperIndex;
+    kingSquareIndex = bitScanForward(board->pieceBB[self + 6]);
+    unsigned long long int snipers = (rookAttacks(kingSquareIndex, 0) & (board->pieceBB[opp + 4] | board->pieceBB[opp + 5]))
+        | (bishopAttacks(kingSquareIndex, 0) & (board->pieceBB[opp + 3] | board->pieceBB[opp + 5]));
+    unsigned long long int pinned = 0, blockers;
+    if (snipers) do {
+        sniperIndex = bitScanForward(snipers);
+        blockers = betweenBB[kingSquareIndex][sniperIndex] & board->occupiedBB;
+        if (blockers && !(blockers & (blockers - 1))) pinned |= blockers;
+    } while (snipers &= snipers - 1);
+    return pinned & board->pieceBB[self];
+}
+
+// Pawns of the player to move that can take en passant. Taking the pawn empties two squares on the same rank at once,
+// which can uncover an attack on the king that the pin and check masks don't see, so the slider attacks on the
+// king are looked at again with the board as it would be after the capture.
+unsigned long long int epCapturers(Board *board, unsigned long long int pushCapMask) {
+    if (!board->epSquare) return 0;
+    int self = board->playerToMove * 7, opp = 7 - self;
+    unsigned long long int capturers, captured, occupiedAfter, legal = 0;
+    unsigned long int squareIndex, kingSquareIndex;
+    // Squares a pawn of the player to move would capture onto the ep square from
+    if (board->playerToMove) { // Black ep
+        capturers = (((board->epSquare << 7) & notAFile) | ((board->epSquare << 9) & notHFile)) & board->pieceBB[self + 1];
+        captured = board->epSquare << 8;
+    }
+    else { // White ep
+        capturers = (((board->epSquare >> 9) & notAFile) | ((board->epSquare >> 7) & notHFile)) & board->pieceBB[self + 1];
+        captured = board->epSquare >> 8;
+    }
+    // In check, the capture has to take the checker or land on the line to it
+    if (!(pushCapMask & (captured | board->epSquare))) return 0;
+
+    kingSquareIndex = bitScanForward(board->pieceBB[self + 6]);
+    if (capturers) do {
+        STAT_INC(epChecks);
+        squareIndex = bitScanForward(capturers);
+        occupiedAfter = (board->occupiedBB ^ (1ULL << squareIndex) ^ captured) | board->epSquare;
+        if (!(rookAttacks(kingSquareIndex, occupiedAfter) & (board->pieceBB[opp + 4] | board->pieceBB[opp + 5]))
+            && !(bishopAttacks(kingSquareIndex, occupiedAfter) & (board->pieceBB[opp + 3] | board->pieceBB[opp + 5]))) {
+            legal |= 1ULL << squareIndex;
+        }
+    } while (capturers &= capturers - 1);
+    return legal;
+}
+
+// Squares one pawn can move to, not counting en passant. Double pushes are kept apart since they are a different
+// kind of move. Neither is masked for checks or pins yet.
+unsigned long long int pawnTargets(Board *board, unsigned long long int square, unsigned long long int *doublePush) {
+    int opp = 7 * !board->playerToMove;
+    unsigned long long int captures = ((board->playerToMove) ? (
+          ((square >> 7) & notHFile) | ((square >> 9) & notAFile))
+        : (((square << 9) & notHFile) | ((square << 7) & notAFile))
+        ) & board->pieceBB[opp];
+    unsigned long long int push = ((board->playerToMove) ? square >> 8 : square << 8) & board->emptyBB;
+    *doublePush = ((board->playerToMove) ? (push & 0x0000FF0000000000ULL) >> 8 : (push & 0x0000000000FF0000ULL) << 8) & board->emptyBB;
+    return push | captures;
+}
+
+// Which moves generateMovesOfType adds. Promotions count as captures, even onto an empty square, since they change
+// the material like one does.
+#define GEN_CAPTURES 1
+#define GEN_QUIETS 2
+#define GEN_ALL 3
+
+// Legal moves only are added to move list, just those of the given type and from squares in fromMask
+// Every piece's targets are cut down to the push/capture mask, and pinned pieces' targets to the line through the
+// king, so no move has to be tried on the board to see if it is legal.
+void generateMovesOfType(MoveBuffer *ml, Board *board, int type, unsigned long long int fromMask) {
+    STAT_TIMER_START(timer);
+    STAT_INC(generateCalls);
     unsigned long long int pushCapMask = 0;
     makePushAndCaptureMask(board, &pushCapMask);
+    unsigned long long int promotionRank = (board->playerToMove) ? 0x00000000000000FFULL : 0xFF00000000000000ULL;
+    unsigned long long int targetMask = 0, pawnMask = 0;
+    if (type & GEN_CAPTURES) {
+        targetMask |= board->pieceBB[7 * !board->playerToMove];
+        pawnMask |= board->pieceBB[7 * !board->playerToMove] | promotionRank;
+    }
+    if (type & GEN_QUIETS) {
+        targetMask |= board->emptyBB;
+        pawnMask |= board->emptyBB & ~promotionRank;
+    }
     int epSquareIndex = 0;
-    if (board->epSquare) BitScanForward64(&epSquareIndex, board->epSquare);
+    if (board->epSquare) epSquareIndex = bitScanForward(board->epSquare);
     // Generate king moves
     int self = board->playerToMove * 7;
-    int opp = 7 - self;
     int king = self + 6;
-    unsigned long long int bAndQ = board->pieceBB[opp + 3] | board->pieceBB[opp + 5];
-    unsigned long long int rAndQ = board->pieceBB[opp + 4] | board->pieceBB[opp + 5];
-    unsigned long long int unsafeSquares;
     // Find the squares king can't move to
-    unsafeSquares  = squaresSeen(board->emptyBB ^ board->pieceBB[king], board->pieceBB[opp + 1], 1, opp);
-    unsafeSquares |= squaresSeen(board->emptyBB ^ board->pieceBB[king], board->pieceBB[opp + 2], 2, opp);
-    unsafeSquares |= squaresSeen(board->emptyBB ^ board->pieceBB[king], bAndQ, 3, opp);
-    unsafeSquares |= squaresSeen(board->emptyBB ^ board->pieceBB[king], rAndQ, 4, opp);
-    // Pseudo-legal non-castling king moves
-    unsigned long long int kingDestinations = (board->pieceBB[king] << 1) & notHFile;
-    kingDestinations |= (kingDestinations >> 2) & notAFile;
-    kingDestinations |= kingDestinations >> 8;
-    kingDestinations |= (kingDestinations | board->pieceBB[king]) << 8;
-    kingDestinations |= board->pieceBB[king] >> 8;
-    // Get rid of the ones to unsafe squares and those occupied by ones own pieces
-    kingDestinations = ~board->pieceBB[self] & ~unsafeSquares & kingDestinations;
+    unsigned long long int unsafeSquares = kingDangerSquares(board);
+    unsigned long long int kingDestinations = (board->pieceBB[king] & fromMask) ? kingTargets(board, unsafeSquares) & targetMask : 0;
     // Enter non-castling legal king moves into move list
-    int squareIndex, targetSquareIndex, cPiece, kingSquareIndex;
-    BitScanForward64(&kingSquareIndex, board->pieceBB[king]);
+    int squareIndex, targetSquareIndex, kingSquareIndex;
+    kingSquareIndex = bitScanForward(board->pieceBB[king]);
+    STAT_ADD(movesGenerated[6], popCount(kingDestinations));
     if (kingDestinations) do {
-        BitScanForward64(&squareIndex, kingDestinations);
-        cPiece = board->boardBySquare[squareIndex];
-        
-        addMove(ml, formMove(kingSquareIndex, squareIndex, 6, cPiece, false, false, false,
-            board->castlingRights[0], board->castlingRights[1], board->castlingRights[2], board->castlingRights[3],
-            epSquareIndex, board->halfMoveClock));
+        squareIndex = bitScanForward(kingDestinations);
+        pushMove(ml, formMove(kingSquareIndex, squareIndex, board->boardBySquare[squareIndex] != 0, false, false, false));
     } while (kingDestinations &= kingDestinations - 1);
     // Generate legal castling moves
-    if (board->playerToMove) { // Black castling
-        if (board->castlingRights[2] && !(unsafeSquares & 0x0E00000000000000ULL) && !(board->occupiedBB & 0x0600000000000000ULL)) {
-            addMove(ml, formMove(59, 57, 6, 0, false, true, false,
-                board->castlingRights[0], board->castlingRights[1], board->castlingRights[2], board->castlingRights[3],
-                epSquareIndex, board->halfMoveClock));
-        }
-        if (board->castlingRights[3] && !(unsafeSquares & 0x3800000000000000ULL) && !(board->occupiedBB & 0x7000000000000000ULL)) {
-            addMove(ml, formMove(59, 61, 6, 0, false, true, true,
-                board->castlingRights[0], board->castlingRights[1], board->castlingRights[2], board->castlingRights[3],
-                epSquareIndex, board->halfMoveClock));
-        }
-    }
-    else { // white castling
-        if (board->castlingRights[0] && !(unsafeSquares & 0x000000000000000EULL) && !(board->occupiedBB & 0x0000000000000006ULL)) {
-            addMove(ml, formMove(3, 1, 6, 0, false, true, false,
-                board->castlingRights[0], board->castlingRights[1], board->castlingRights[2], board->castlingRights[3],
-                epSquareIndex, board->halfMoveClock));
-        }
-        if (board->castlingRights[1] && !(unsafeSquares & 0x0000000000000038ULL) && !(board->occupiedBB & 0x0000000000000070ULL)) {
-            addMove(ml, formMove(3, 5, 6, 0, false, true, true,
-                board->castlingRights[0], board->castlingRights[1], board->castlingRights[2], board->castlingRights[3],
-                epSquareIndex, board->halfMoveClock));
-        }
-    }
-    // Set bitboard of pinned pieces for player to move
-    // Shoot ray from slider pieces and from king in opposite difections, intersection of these rays gives pinned pieces and possible discovered checks.
-    // It also gives a line from the king to a checker if the king is in check, which is okay since any of those squares are
-    // empty and intersecting with piece set gets rid of those.
-    // Intersecting pinned with one's pieces will give which of them are pinned pieces.
-    unsigned long long int pinned = 0, free, tempP, tempF;
-    pinned |= ur(board->pieceBB[king], board->emptyBB) & dl(bAndQ, board->emptyBB);
-    pinned |= ul(board->pieceBB[king], board->emptyBB) & dr(bAndQ, board->emptyBB);
-    pinned |= dl(board->pieceBB[king], board->emptyBB) & ur(bAndQ, board->emptyBB);
-    pinned |= dr(board->pieceBB[king], board->emptyBB) & ul(bAndQ, board->emptyBB);
-    pinned |= u(board->pieceBB[king], board->emptyBB) & d(rAndQ, board->emptyBB);
-    pinned |= d(board->pieceBB[king], board->emptyBB) & u(rAndQ, board->emptyBB);
-    pinned |= r(board->pieceBB[king], board->emptyBB) & l(rAndQ, board->emptyBB);
-    pinned |= l(board->pieceBB[king], board->emptyBB) & r(rAndQ, board->emptyBB);
-    free = ~pinned;
-    // By only do extra legality checks on pieces which are pinned, time is saved vs checking
-    // for pin on every piece individually and applying a mask to where it can move
-
-    // Generate Pawn Moves
-    tempF = board->pieceBB[self + 1] & free;
-    tempP = board->pieceBB[self + 1] & pinned;
-    unsigned long long int square;
-    if (tempF) do {
-        BitScanForward64(&squareIndex, tempF);
-        square = 1ULL << squareIndex;
-        unsigned long long int move;
-        // Generate ep captures
-        // I don't need to apply push or capture mask, since it will look for check after making the move anyway
-        if (board->playerToMove && board->epSquare && ((((square >> 7) & notHFile) | ((square >> 9) & notAFile)) & board->epSquare)) { // Black ep
-            // Generate ep move
-            move = formMove(squareIndex, epSquareIndex, 1, 1, false, true, false,
-                board->castlingRights[0], board->castlingRights[1], board->castlingRights[2], board->castlingRights[3],
-                epSquareIndex, board->halfMoveClock);
-            // legality check
-            makeMove(board, move);
-            // Look for check
-            bool isLegal = !inCheck(board, !board->playerToMove);
-            unmakeMove(board, move);
-            // If doesn't put king in check add the move to the list
-            if (isLegal) addMove(ml, move);
-        }
-        else if (board->epSquare && ((((square << 9) & notHFile) | ((square << 7) & notAFile)) & board->epSquare)) { // White ep            
-            // Generate ep move
-            // I don't need to apply push or capture mask, since it will look for check after making the move anyway
-            move = formMove(squareIndex, epSquareIndex, 1, 1, false, true, false,
-                board->castlingRights[0], board->castlingRights[1], board->castlingRights[2], board->castlingRights[3],
-                epSquareIndex, board->halfMoveClock);
-            // legality check
-            makeMove(board, move);
-            // Look for check
-            bool isLegal = !inCheck(board, !board->playerToMove);
-            unmakeMove(board, move);
-            // If doesn't put king in check add the move to the list
-            if (isLegal) addMove(ml, move);
-        }
-        // non-ep moves for the pawn
-        unsigned long long int captures = ((board->playerToMove) ? (
-              ((square >> 7) & notHFile) | ((square >> 9) & notAFile)) 
-            : (((square << 9) & notHFile) | ((square << 7) & notAFile))
-            ) & board->pieceBB[opp];
-        unsigned long long int push = ((board->playerToMove) ? square >> 8 : square << 8) & board->emptyBB;
-        unsigned long long int doublePush = ((board->playerToMove) ? (push & 0x0000FF0000000000ULL) >> 8 : (push & 0x0000000000FF0000ULL) << 8) & board->emptyBB;
-        doublePush &= pushCapMask;
-        unsigned long long int targets = (push | captures) & pushCapMask;
-        if (doublePush) {
-            BitScanForward64(&targetSquareIndex, doublePush);
-            addMove(ml, formMove(squareIndex, targetSquareIndex, 1, board->boardBySquare[targetSquareIndex], false, false, true,
-                board->castlingRights[0], board->castlingRights[1], board->castlingRights[2], board->castlingRights[3],
-                epSquareIndex, board->halfMoveClock));
+    if ((type & GEN_QUIETS) && (board->pieceBB[king] & fromMask)) {
+        if (board->playerToMove) { // Black castling
+            if (board->castlingRights[2] && !(unsafeSquares & 0x0E00000000000000ULL) && !(board->occupiedBB & 0x0600000000000000ULL)) {
+                pushMove(ml, formMove(59, 57, false, false, true, false));
+                STAT_INC(movesGenerated[6]);
+            }
+            if (board->castlingRights[3] && !(unsafeSquares & 0x3800000000000000ULL) && !(board->occupiedBB & 0x7000000000000000ULL)) {
+                pushMove(ml, formMove(59, 61, false, false, true, true));
+                STAT_INC(movesGenerated[6]);
+            }
         }
-        if (targets) do {
-            BitScanForward64(&targetSquareIndex, targets);
-            bool isPromotion =
-                (board->playerToMove && (targetSquareIndex < 8))
-                || ((!board->playerToMove) && (targetSquareIndex > 55));
-            if (isPromotion) {
-                addMove(ml, formMove(squareIndex, targetSquareIndex, 1, board->boardBySquare[targetSquareIndex], true, false, false,
-                    board->castlingRights[0], board->castlingRights[1], board->castlingRights[2], board->castlingRights[3],
-                    epSquareIndex, board->halfMoveClock));
-                addMove(ml, formMove(squareIndex, targetSquareIndex, 1, board->boardBySquare[targetSquareIndex], true, false, true,
-                    board->castlingRights[0], board->castlingRights[1], board->castlingRights[2], board->castlingRights[3],
-                    epSquareIndex, board->halfMoveClock));
-                addMove(ml, formMove(squareIndex, targetSquareIndex, 1, board->boardBySquare[targetSquareIndex], true, true, false,
-                    board->castlingRights[0], board->castlingRights[1], board->castlingRights[2], board->castlingRights[3],
-                    epSquareIndex, board->halfMoveClock));
-                addMove(ml, formMove(squareIndex, targetSquareIndex, 1, board->boardBySquare[targetSquareIndex], true, true, true,
-                    board->castlingRights[0], board->castlingRights[1], board->castlingRights[2], board->castlingRights[3],
-                    epSquareIndex, board->halfMoveClock));
+        else { // white castling
+            if (board->castlingRights[0] && !(unsafeSquares & 0x000000000000000EULL) && !(board->occupiedBB & 0x0000000000000006ULL)) {
+                pushMove(ml, formMove(3, 1, false, false, true, false));
+                STAT_INC(movesGenerated[6]);
             }
-            else {
-                addMove(ml, formMove(squareIndex, targetSquareIndex, 1, board->boardBySquare[targetSquareIndex], false, false, false,
-                    board->castlingRights[0], board->castlingRights[1], board->castlingRights[2], board->castlingRights[3],
-                    epSquareIndex, board->halfMoveClock));
+            if (board->castlingRights[1] && !(unsafeSquares & 0x0000000000000038ULL) && !(board->occupiedBB & 0x0000000000000070ULL)) {
+                pushMove(ml, formMove(3, 5, false, false, true, true));
+                STAT_INC(movesGenerated[6]);
             }
-        } while (targets &= targets - 1);
-    } while (tempF &= tempF - 1);
+        }
+    }
+    // Only the king can move out of double check
+    if (!pushCapMask) {
+        STAT_TIMER_STOP(generateCycles, timer);
+        return;
+    }
+    unsigned long long int pinned = findPinned(board), pieces, square, doublePush, targets;
+
+    // Generate Pawn Moves
+    pieces = (type & GEN_CAPTURES) ? epCapturers(board, pushCapMask) & fromMask : 0;
+    STAT_ADD(movesGenerated[1], popCount(pieces));
+    if (pieces) do {
+        squareIndex = bitScanForward(pieces);
+        pushMove(ml, formMove(squareIndex, epSquareIndex, true, false, true, false));
+    } while (pieces &= pieces - 1);
 
-    // pinned pawn moves. Same but extra check for legality after generating before adding to the list for all of them, not just ep
-    if (tempP) do {
-        BitScanForward64(&squareIndex, tempP);
+    pieces = board->pieceBB[self + 1] & fromMask;
+    if (pieces) do {
+        squareIndex = bitScanForward(pieces);
         square = 1ULL << squareIndex;
-        unsigned long long int move;
-        // Generate ep captures
-        // I don't need to apply push or capture mask, since it will look for check after making the move anyway
-        if (board->playerToMove && board->epSquare && ((((square >> 7) & notHFile) | ((square >> 9) & notAFile)) & board->epSquare)) { // Black ep
-            // Generate ep move
-            move = formMove(squareIndex, epSquareIndex, 1, 1, false, true, false,
-                board->castlingRights[0], board->castlingRights[1], board->castlingRights[2], board->castlingRights[3],
-                epSquareIndex, board->halfMoveClock);
-            // legality check
-            makeMove(board, move);
-            // Look for check
-            bool isLegal = !inCheck(board, !board->playerToMove);
-            unmakeMove(board, move);
-            // If doesn't put king in check add the move to the list
-            if (isLegal) addMove(ml, move);
-        }
-        else if (board->epSquare && ((((square << 9) & notHFile) | ((square << 7) & notAFile)) & board->epSquare)) { // White ep
-            // Generate ep move
-            // I don't need to apply push or capture mask, since it will look for check after making the move anyway
-            move = formMove(squareIndex, epSquareIndex, 1, 1, false, true, false,
-                board->castlingRights[0], board->castlingRights[1], board->castlingRights[2], board->castlingRights[3],
-                epSquareIndex, board->halfMoveClock);
-            // legality check
-            makeMove(board, move);
-            // Look for check
-            bool isLegal = !inCheck(board, !board->playerToMove);
-            unmakeMove(board, move);
-            // If doesn't put king in check add the move to the list
-            if (isLegal) addMove(ml, move);
-        }
-        // non-ep moves for the pawn
-        unsigned long long int captures = ((board->playerToMove) ? (
-            ((square >> 7) & notHFile) | ((square >> 9) & notAFile))
-            : (((square << 9) & notHFile) | ((square << 7) & notAFile))
-            ) & board->pieceBB[opp];
-        unsigned long long int push = ((board->playerToMove) ? square >> 8 : square << 8) & board->emptyBB;
-        unsigned long long int doublePush = ((board->playerToMove) ? (push & 0x0000FF0000000000ULL) >> 8 : (push & 0x0000000000FF0000ULL) << 8) & board->emptyBB;
-        unsigned long long int targets = (push | captures) & pushCapMask;
+        targets = pawnTargets(board, square, &doublePush) & pushCapMask & pawnMask;
+        doublePush &= pushCapMask & pawnMask;
+        if (square & pinned) {
+            STAT_INC(pinnedPieces);
+            targets &= lineBB[kingSquareIndex][squareIndex];
+            doublePush &= lineBB[kingSquareIndex][squareIndex];
+        }
+        STAT_ADD(movesGenerated[1], (doublePush != 0) + popCount(targets) + 3 * popCount(targets & promotionRank));
         if (doublePush) {
-            BitScanForward64(&targetSquareIndex, doublePush);
-            move = formMove(squareIndex, targetSquareIndex, 1, board->boardBySquare[targetSquareIndex], false, false, true,
-                board->castlingRights[0], board->castlingRights[1], board->castlingRights[2], board->castlingRights[3],
-                epSquareIndex, board->halfMoveClock);
-            // legality check
-            makeMove(board, move);
-            // Look for check
-            bool isLegal = !inCheck(board, !board->playerToMove);
-            unmakeMove(board, move);
-            // If doesn't put king in check add the move to the list
-            if (isLegal) addMove(ml, move);
+            targetSquareIndex = bitScanForward(doublePush);
+            pushMove(ml, formMove(squareIndex, targetSquareIndex, false, false, false, true));
         }
         if (targets) do {
-            BitScanForward64(&targetSquareIndex, targets);
+            targetSquareIndex = bitScanForward(targets);
             bool isPromotion =
                 (board->playerToMove && (targetSquareIndex < 8))
                 || ((!board->playerToMove) && (targetSquareIndex > 55));
+            bool isCapture = board->boardBySquare[targetSquareIndex] != 0;
             if (isPromotion) {
-                move = formMove(squareIndex, targetSquareIndex, 1, board->boardBySquare[targetSquareIndex], true, false, false,
-                    board->castlingRights[0], board->castlingRights[1], board->castlingRights[2], board->castlingRights[3],
-                    epSquareIndex, board->halfMoveClock);
-                // legality check
-                makeMove(board, move);
-                // Look for check
-                bool isLegal = !inCheck(board, !board->playerToMove);
-                unmakeMove(board, move);
-                // If doesn't put king in check add the move to the list
-                if (isLegal) {
-                    addMove(ml, move);
-                    addMove(ml, formMove(squareIndex, targetSquareIndex, 1, board->boardBySquare[targetSquareIndex], true, false, true,
-                        board->castlingRights[0], board->castlingRights[1], board->castlingRights[2], board->castlingRights[3],
-                        epSquareIndex, board->halfMoveClock));
-                    addMove(ml, formMove(squareIndex, targetSquareIndex, 1, board->boardBySquare[targetSquareIndex], true, true, false,
-                        board->castlingRights[0], board->castlingRights[1], board->castlingRights[2], board->castlingRights[3],
-                        epSquareIndex, board->halfMoveClock));
-                    addMove(ml, formMove(squareIndex, targetSquareIndex, 1, board->boardBySquare[targetSquareIndex], true, true, true,
-                        board->castlingRights[0], board->castlingRights[1], board->castlingRights[2], board->castlingRights[3],
-                        epSquareIndex, board->halfMoveClock));
-                }
+                pushMove(ml, formMove(squareIndex, targetSquareIndex, isCapture, true, false, false));
+                pushMove(ml, formMove(squareIndex, targetSquareIndex, isCapture, true, false, true));
+                pushMove(ml, formMove(squareIndex, targetSquareIndex, isCapture, true, true, false));
+                pushMove(ml, formMove(squareIndex, targetSquareIndex, isCapture, true, true, true));
             }
             else {
-                move = formMove(squareIndex, targetSquareIndex, 1, board->boardBySquare[targetSquareIndex], false, false, false,
-                    board->castlingRights[0], board->castlingRights[1], board->castlingRights[2], board->castlingRights[3],
-                    epSquareIndex, board->halfMoveClock);
-                // legality check
-                makeMove(board, move);
-                // Look for check
-                bool isLegal = !inCheck(board, !board->playerToMove);
-                unmakeMove(board, move);
-                // If doesn't put king in check add the move to the list
-                if (isLegal) addMove(ml, move);
+                pushMove(ml, formMove(squareIndex, targetSquareIndex, isCapture, false, false, false));
             }
         } while (targets &= targets - 1);
-    } while (tempP &= tempP - 1);
+    } while (pieces &= pieces - 1);
 
     // Generate other pieces's moves
     for (int piece = 2; piece <= 5; piece++) {
-        tempF = board->pieceBB[self + piece] & free;
-        tempP = board->pieceBB[self + piece] & pinned;
-
-        // Free pieces
-        if (tempF) do {
-            BitScanForward64(&squareIndex, tempF);
+        pieces = board->pieceBB[self + piece] & fromMask;
+        if (pieces) do {
+            squareIndex = bitScanForward(pieces);
             square = 1ULL << squareIndex;
-            unsigned long long int targets = squaresSeen(board->emptyBB, square, piece, board->playerToMove);
-            targets &= pushCapMask;
-            targets &= ~board->pieceBB[self];
-            if (targets) do {
-                BitScanForward64(&targetSquareIndex, targets);
-                addMove(ml, formMove(squareIndex, targetSquareIndex, piece, board->boardBySquare[targetSquareIndex], false, false, false,
-                    board->castlingRights[0], board->castlingRights[1], board->castlingRights[2], board->castlingRights[3],
-                    epSquareIndex, board->halfMoveClock));
-            } while (targets &= targets - 1);
-        } while (tempF &= tempF - 1);
-
-        // Pinned pieces
-        if (tempP) do {
-            BitScanForward64(&squareIndex, tempP);
-            square = 1ULL << squareIndex;
-            unsigned long long int targets = squaresSeen(board->emptyBB, square, piece, board->playerToMove);
-            targets &= ~board->pieceBB[self];
-            targets &= pushCapMask;
-
-            unsigned long long int pinnedMask = 0;
-            // remove piece from board temporarily, find push/capture mask without the pinned piece, that is now the pin mask for that piece
-            // as long as the piece stays within the masked tiles there is no need to look for check before adding the move to the list.
-            removeOrPlacePiece(board, square, piece, board->playerToMove);
-            makePushAndCaptureMask(board, &pinnedMask);
-            removeOrPlacePiece(board, square, piece, board->playerToMove);
-            targets &= pinnedMask;
-
+            targets = squaresSeen(board->emptyBB, square, piece, board->playerToMove) & pushCapMask & targetMask;
+            if (square & pinned) {
+                STAT_INC(pinnedPieces);
+                targets &= lineBB[kingSquareIndex][squareIndex];
+            }
+            STAT_ADD(movesGenerated[piece], popCount(targets));
             if (targets) do {
-                BitScanForward64(&targetSquareIndex, targets);
-                BitScanForward64(&targetSquareIndex, targets);
-                addMove(ml, formMove(squareIndex, targetSquareIndex, piece, board->boardBySquare[targetSquareIndex], false, false, false,
-                    board->castlingRights[0], board->castlingRights[1], board->castlingRights[2], board->castlingRights[3],
-                    epSquareIndex, board->halfMoveClock));
+                targetSquareIndex = bitScanForward(targets);
+                pushMove(ml, formMove(squareIndex, targetSquareIndex, board->boardBySquare[targetSquareIndex] != 0, false, false, false));
             } while (targets &= targets - 1);
-        } while (tempP &= tempP - 1);
+        } while (pieces &= pieces - 1);
     }
+    STAT_TIMER_STOP(generateCycles, timer);
 }
 
-void showAvailableMoves(Board *board) {
-    MoveList moves;
-    initMoveList(&moves, 30);
-    char moveText[5] = {'\0'};
+void generateMoves(MoveBuffer *ml, Board *board) {
+    generateMovesOfType(ml, board, GEN_ALL, ~0ULL);
+}
 
-    generateMoves(&moves, board);
+// Whether a move from somewhere else, the hash table or another position's killers, can be played here. Only the
+// moving piece's moves are generated to check.
+bool isLegalMove(Board *board, Move move) {
+    STAT_INC(legalityChecks);
+    MoveBuffer moves;
+    moves.length = 0;
+    generateMovesOfType(&moves, board, (getIsCapture(move) || getIsPromotion(move)) ? GEN_CAPTURES : GEN_QUIETS, 1ULL << getFrom(move));
     for (int i = 0; i < moves.length; i++) {
-        moveToText(moveText, moves.moves[i]);
-        printf("%d. %s\n", i + 1, moveText);
+        if (moves.moves[i] == move) return true;
     }
-    destroyMoveList(&moves);
+    return false;
 }
 
-unsigned long long int perft(Board *board, int depth) {
-    // Finishes depth of 7 in about 7 minutes from starting position, with results that match stockfish.
+// Same result as generateMoves(ml, board) followed by ml->length, but without forming the moves.
+// Whole sets of targets are counted at once where pins don't get in the way.
+int countLegalMoves(Board *board) {
+    STAT_TIMER_START(timer);
+    STAT_INC(countCalls);
+    unsigned long long int pushCapMask = 0;
+    makePushAndCaptureMask(board, &pushCapMask);
+    int self = board->playerToMove * 7;
+    int opp = 7 - self;
+    unsigned long long int unsafeSquares = kingDangerSquares(board);
+    int count = popCount(kingTargets(board, unsafeSquares));
 
-    if (depth == 0) return 1;
-    unsigned long long int count = 0;
-    MoveList legalMoves;
-    initMoveList(&legalMoves, 40);
-    generateMoves(&legalMoves, board);
-    if (depth == 1) {
-        destroyMoveList(&legalMoves);
-        return legalMoves.length;
+    // Castling
+    if (board->playerToMove) {
+        count += board->castlingRights[2] && !(unsafeSquares & 0x0E00000000000000ULL) && !(board->occupiedBB & 0x0600000000000000ULL);
+        count += board->castlingRights[3] && !(unsafeSquares & 0x3800000000000000ULL) && !(board->occupiedBB & 0x7000000000000000ULL);
+    }
+    else {
+        count += board->castlingRights[0] && !(unsafeSquares & 0x000000000000000EULL) && !(board->occupiedBB & 0x0000000000000006ULL);
+        count += board->castlingRights[1] && !(unsafeSquares & 0x0000000000000038ULL) && !(board->occupiedBB & 0x0000000000000070ULL);
+    }
+    // Only the king can move out of double check, and pushCapMask is empty then
+    if (!pushCapMask) {
+        STAT_TIMER_STOP(countCycles, timer);
+        return count;
     }
 
-    for (int i = 0; i < legalMoves.length; i++) {
-        makeMove(board, legalMoves.moves[i]);
-        count += perft(board, depth - 1);
-        unmakeMove(board, legalMoves.moves[i]);
+    unsigned long long int pinned = findPinned(board);
+    unsigned long long int pawns = board->pieceBB[self + 1] & ~pinned;
+    unsigned long long int push, doublePush, capturesLeft, capturesRight, promotionRank;
+    unsigned long int squareIndex, kingSquareIndex;
+    kingSquareIndex = bitScanForward(board->pieceBB[self + 6]);
+
+    // Free pawns, all of them at once. Each set has at most one move per target square.
+    if (board->playerToMove) {
+        push = (pawns >> 8) & board->emptyBB;
+        doublePush = ((push & 0x0000FF0000000000ULL) >> 8) & board->emptyBB;
+        capturesLeft = (pawns >> 7) & notHFile & board->pieceBB[opp];
+        capturesRight = (pawns >> 9) & notAFile & board->pieceBB[opp];
+        promotionRank = 0x00000000000000FFULL;
     }
-    destroyMoveList(&legalMoves);
-    return count;
-}
+    else {
+        push = (pawns << 8) & board->emptyBB;
+        doublePush = ((push & 0x0000000000FF0000ULL) << 8) & board->emptyBB;
+        capturesLeft = (pawns << 9) & notHFile & board->pieceBB[opp];
+        capturesRight = (pawns << 7) & notAFile & board->pieceBB[opp];
+        promotionRank = 0xFF00000000000000ULL;
+    }
+    push &= pushCapMask;
+    capturesLeft &= pushCapMask;
+    capturesRight &= pushCapMask;
+    count += (int)(popCount(push) + popCount(doublePush & pushCapMask) + popCount(capturesLeft) + popCount(capturesRight));
+    // Each promotion is four moves, one was counted above
+    count += 3 * (int)(popCount(push & promotionRank) + popCount(capturesLeft & promotionRank) + popCount(capturesRight & promotionRank));
+    count += popCount(epCapturers(board, pushCapMask));
 
-void divide(Board *board, int depth) {
-    if (depth == 0) return;
-    MoveList legalMoves;
-    initMoveList(&legalMoves, 40);
-    generateMoves(&legalMoves, board);
-    unsigned long long int movCount = 0, posCount = 0, subCount;
+    // Pinned pawns one at a time, each has its own line
+    pawns = board->pieceBB[self + 1] & pinned;
+    STAT_ADD(pinnedPieces, popCount(pawns));
+    if (pawns) do {
+        squareIndex = bitScanForward(pawns);
+        unsigned long long int targets = pawnTargets(board, 1ULL << squareIndex, &doublePush) & pushCapMask & lineBB[kingSquareIndex][squareIndex];
+        count += popCount(doublePush & pushCapMask & lineBB[kingSquareIndex][squareIndex]);
+        count += popCount(targets) + 3 * popCount(targets & promotionRank);
+    } while (pawns &= pawns - 1);
 
-    for (int i = 0; i < legalMoves.length; i++) {
-        char moveText[5] = { '\0' };
-        moveToText(moveText, legalMoves.moves[i]);
-        printf("%s - ", moveText);
-        makeMove(board, legalMoves.moves[i]);
-        subCount = perft(board, depth - 1);
-        posCount += subCount;
-        unmakeMove(board, legalMoves.moves[i]);
-        printf("%llu\n", subCount);
+    // Other pieces
+    unsigned long long int pieces, square;
+    for (int piece = 2; piece <= 5; piece++) {
+        pieces = board->pieceBB[self + piece];
+        if (pieces) do {
+            squareIndex = bitScanForward(pieces);
+            square = 1ULL << squareIndex;
+            unsigned long long int targets = squaresSeen(board->emptyBB, square, piece, board->playerToMove) & pushCapMask & ~board->pieceBB[self];
+            if (square & pinned) {
+                STAT_INC(pinnedPieces);
+                targets &= lineBB[kingSquareIndex][squareIndex];
+            }
+            count += popCount(targets);
+        } while (pieces &= pieces - 1);
     }
-    destroyMoveList(&legalMoves);
-    printf("moves: %d\npositions: %llu", legalMoves.length, posCount);
+    STAT_TIMER_STOP(countCycles, timer);
+    return count;
 }
 
-parseInt(char *string, int *integer) {
-    *integer = 0;
-    while (*string != '\0') {
-        *integer *= 10;
-        *integer += (*string) - '0';
-        string++;
-    }
+// FEN and EPD. parseFen checks everything the move generator relies on before it touches the board, so a bad string
+// can't leave it half set up. Neither it nor writeFen allocates, and the FenReader below feeds parseFen straight
+// out of a mapped file, so datasets of millions of positions go through without a copy or allocation per line.
+
+// What parseFen can find wrong. FEN_END isn't an error, it's what readNextFen returns at the end of the file.
+#define FEN_END -1
+#define FEN_OK 0
+#define FEN_BAD_PLACEMENT 1
+#define FEN_BAD_KINGS 2
+#define FEN_BAD_PAWNS 3
+#define FEN_BAD_SIDE 4
+#define FEN_BAD_CASTLING 5
+#define FEN_BAD_EP 6
+#define FEN_BAD_CLOCKS 7
+#define FEN_TRAILING_TEXT 8
+#define FEN_KING_CAPTURABLE 9
+
+// Longest FEN writeFen can produce, terminator included
+#define FEN_BUFFER_SIZE 128
+
+const char* fenErrorText(int error) {
+    static const char* texts[] = {
+        "no error",
+        "bad piece placement",
+        "each side needs exactly one king",
+        "pawn on the first or last rank",
+        "side to move isn't w or b",
+        "castling rights without the king and rook on their squares",
+        "bad en passant square",
+        "bad move clocks",
+        "unexpected text after the FEN",
+        "the side not to move is in check",
+    };
+    return (error >= 0 && error < (int)(sizeof(texts) / sizeof(texts[0]))) ? texts[error] : "end of file";
 }
 
-DWORD WINAPI ioThread(LPVOID lpParameter) {
-    Board *board = ((Parameters*)lpParameter)->board;
-    char* pieceSymbols = ((Parameters*)lpParameter)->pieceSymbols;
+// What each letter means in the placement field: the pieceBB index in the low 4 bits, then how many squares it
+// covers, then whether it is a slash, ends the field or can be there at all. 0 for anything that can't.
+#define FEN_WIDTH_SHIFT 4
+#define FEN_SLASH (1 << 8)
+#define FEN_STOP (1 << 9)
+#define FEN_VALID (1 << 10)
+#define FEN_PIECE(piece) ((piece) | 1 << FEN_WIDTH_SHIFT | FEN_VALID)
+#define FEN_EMPTY(squares) ((squares) << FEN_WIDTH_SHIFT | FEN_VALID)
+static const unsigned short fenLetters[256] = {
+    ['P'] = FEN_PIECE(1), ['N'] = FEN_PIECE(2), ['B'] = FEN_PIECE(3), ['R'] = FEN_PIECE(4), ['Q'] = FEN_PIECE(5), ['K'] = FEN_PIECE(6),
+    ['p'] = FEN_PIECE(8), ['n'] = FEN_PIECE(9), ['b'] = FEN_PIECE(10), ['r'] = FEN_PIECE(11), ['q'] = FEN_PIECE(12), ['k'] = FEN_PIECE(13),
+    ['1'] = FEN_EMPTY(1), ['2'] = FEN_EMPTY(2), ['3'] = FEN_EMPTY(3), ['4'] = FEN_EMPTY(4),
+    ['5'] = FEN_EMPTY(5), ['6'] = FEN_EMPTY(6), ['7'] = FEN_EMPTY(7), ['8'] = FEN_EMPTY(8),
+    ['/'] = FEN_SLASH | FEN_VALID, [' '] = FEN_STOP | FEN_VALID, ['\t'] = FEN_STOP | FEN_VALID,
+};
 
-    char buffer[100] = {'\0'};
-    printf("Welcome to MyChessEngine\nThe board is currently set up at the starting position\nFor a list of commands type \"help\"\nTo exit type q or quit\n");
-    printf("Please keep in mind that his will break if given bad or incorrect input,\nthere is no verification that user provided information is reasonable,\n");
-    printf("the move generation also assumes all of the board state information is correct,\nif this is not the case then there may be unexpected side effects\n");
-    printf("which made debugging a pain.");
-    while (1) {
-        printf("\n> ");
-        gets_s(buffer, sizeof(buffer));
+// Skips the spaces between two fields, false if there are none
+static inline bool skipFenSpaces(const char **c, const char *end) {
+    if (*c == end || (**c != ' ' && **c != '\t')) return false;
+    do (*c)++; while (*c != end && (**c == ' ' || **c == '\t'));
+    return true;
+}
 
-        if (!strcmp(buffer, "q") || !strcmp(buffer, "quit")) return;
-        else if (!strcmp(buffer, "help")) {
-            printf("q - quits the engine\n");
-            printf("show - shows the board and FEN string\n");
-            printf("showboard - shows just the board\n");
-            printf("showfen - shows just the FEN string\n");
-            printf("setfen <FEN> - sets the board tho the FEN string\n");
-        }
-        else if (!strcmp(buffer, "show")) printBoard(1, 1, board, pieceSymbols);
-        else if (!strcmp(buffer, "showboard")) printBoard(0, 1, board, pieceSymbols);
-        else if (!strcmp(buffer, "showfen")) printBoard(1, 0, board, pieceSymbols);
-        else if (!memcmp(buffer, "setfen", 6)) readFenStringToBoard(buffer + 7, board);
-        else if (!memcmp(buffer, "new", 3)) readFenStringToBoard("rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1", board);
-        else if (!strcmp(buffer, "legalmoves")) showAvailableMoves(board);
-        else if (!memcmp(buffer, "move", 4)) makeMove(board, textToMove(buffer + 5, board));
-        else if (!memcmp(buffer, "undo", 4)) unmakeLastMove(board);
-        else if (!memcmp(buffer, "perft", 5)) {
-            int depth;
-            parseInt(buffer + 6, &depth);
-            printf("%llu\n", perft(board, depth));
-        }
-        else if (!memcmp(buffer, "divide", 6)) {
-            int depth;
-            parseInt(buffer + 7, &depth);
-            divide(board, depth);
-        }
-        else if (!strcmp(buffer, "showsbb")) printSquareBasedBoard(board);
+// Up to five digits, false if there are none or more
+static inline bool parseFenNumber(const char **c, const char *end, int *value) {
+    int digits = 0;
+    *value = 0;
+    while (*c != end && **c >= '0' && **c <= '9') {
+        if (++digits > 5) return false;
+        *value = *value * 10 + *(*c)++ - '0';
     }
-    return 0;
+    return digits > 0;
 }
 
-int main() {
-    Board* mainBoard;
+// Parses the FEN starting at text and ending at end at the latest into board. The clocks can be left out, as EPD
+// does, and are then 0 and 1. Returns FEN_OK, or what's wrong with the board left as it was. If fenEnd isn't NULL
+// it is set to just past the FEN, where EPD operations or a UCI move list start.
+int parseFen(Board *board, const char *text, const char *end, const char **fenEnd) {
+    unsigned long long int pieceBB[14] = { 0 };
+    int boardBySquare[64] = { 0 };
+    const char* c = text;
+
+    // Placement, a8 to h1, which is bit 63 down to bit 0. With real data the next letter's kind can't be predicted,
+    // so the loop has no branches but its own. Digits and slashes count as piece 0, which has all zero rows in the
+    // key and score tables, and its bitboard is overwritten below. The key and scores are summed up on the way.
+    // Rather than counting files, where each slash was is remembered: with every rank ending on the square the
+    // next one starts from and the last one on h1, none can be too long or too short.
+    int squareIndex = 63, slashes = 0, scoreMg = 0, scoreEg = 0, phase = 0, slashSquares[8];
+    unsigned long long int key = 0;
+    unsigned int letter, isBad = 0;
+    while (c != end && !((letter = fenLetters[(unsigned char)*c]) & FEN_STOP)) {
+        c++;
+        int piece = letter & 15, index = squareIndex & 63;
+        isBad |= ~letter & FEN_VALID;
+        slashSquares[slashes & 7] = squareIndex;
+        slashes += (letter & FEN_SLASH) != 0;
+        pieceBB[piece] |= 1ULL << index;
+        boardBySquare[index] = piece % 7;
+        key ^= zobristPieces[piece][index];
+        scoreMg += pieceScoresMg[piece][index];
+        scoreEg += pieceScoresEg[piece][index];
+        phase += phaseWeights[piece % 7];
+        squareIndex -= (letter >> FEN_WIDTH_SHIFT) & 15;
+    }
+    if (isBad || slashes != 7 || squareIndex != -1) return FEN_BAD_PLACEMENT;
+    for (int rank = 0; rank < 7; rank++) {
+        if (slashSquares[rank] != 55 - 8 * rank) return FEN_BAD_PLACEMENT;
+    }
+    pieceBB[0] = pieceBB[1] | pieceBB[2] | pieceBB[3] | pieceBB[4] | pieceBB[5] | pieceBB[6];
+    pieceBB[7] = pieceBB[8] | pieceBB[9] | pieceBB[10] | pieceBB[11] | pieceBB[12] | pieceBB[13];
+    unsigned long long int occupied = pieceBB[0] | pieceBB[7];
+    if (popCount(pieceBB[6]) != 1 || popCount(pieceBB[13]) != 1) return FEN_BAD_KINGS;
+    if ((pieceBB[1] | pieceBB[8]) & 0xFF000000000000FFULL) return FEN_BAD_PAWNS;
+
+    // Side to move
+    skipFenSpaces(&c, end);
+    if (c == end || (*c != 'w' && *c != 'b')) return FEN_BAD_SIDE;
+    int side = *c++ == 'b';
+
+    // Castling. Every right needs its king and rook at home, the move generator doesn't look.
+    bool castlingRights[4] = { false, false, false, false };
+    if (!skipFenSpaces(&c, end) || c == end) return FEN_BAD_CASTLING;
+    if (*c == '-') c++;
+    else {
+        const char* start = c;
+        while (c != end) {
+            if (*c == 'K') castlingRights[0] = true;
+            else if (*c == 'Q') castlingRights[1] = true;
+            else if (*c == 'k') castlingRights[2] = true;
+            else if (*c == 'q') castlingRights[3] = true;
+            else break;
+            c++;
+        }
+        if (c == start) return FEN_BAD_CASTLING;
+    }
+    if ((castlingRights[0] && (!(pieceBB[6] & 0x0000000000000008ULL) || !(pieceBB[4] & 0x0000000000000001ULL)))
+        || (castlingRights[1] && (!(pieceBB[6] & 0x0000000000000008ULL) || !(pieceBB[4] & 0x0000000000000080ULL)))
+        || (castlingRights[2] && (!(pieceBB[13] & 0x0800000000000000ULL) || !(pieceBB[11] & 0x0100000000000000ULL)))
+        || (castlingRights[3] && (!(pieceBB[13] & 0x0800000000000000ULL) || !(pieceBB[11] & 0x8000000000000000ULL)))) {
+        return FEN_BAD_CASTLING;
+    }
+
+    // En passant. There has to be a pawn that could just have made the double push.
+    unsigned long long int epSquare = 0;
+    if (!skipFenSpaces(&c, end) || c == end) return FEN_BAD_EP;
+    if (*c == '-') c++;
+    else {
+        if (end - c < 2 || c[0] < 'a' || c[0] > 'h' || c[1] != ((side) ? '3' : '6')) return FEN_BAD_EP;
+        epSquare = 1ULL << (('h' - c[0]) + 8 * (c[1] - '1'));
+        unsigned long long int pushed = (side) ? epSquare << 8 : epSquare >> 8;
+        unsigned long long int origin = (side) ? epSquare >> 8 : epSquare << 8;
+        if (!(pieceBB[7 * !side + 1] & pushed) || (occupied & (epSquare | origin))) return FEN_BAD_EP;
+        c += 2;
+    }
+
+    // Clocks, if there are any
+    int halfMoveClock = 0, fullMoveNumber = 1;
+    const char* fieldsEnd = c;
+    if (skipFenSpaces(&c, end) && c != end && *c >= '0' && *c <= '9') {
+        if (!parseFenNumber(&c, end, &halfMoveClock)) return FEN_BAD_CLOCKS;
+        fieldsEnd = c;
+        if (skipFenSpaces(&c, end) && c != end && *c >= '0' && *c <= '9') {
+            if (!parseFenNumber(&c, end, &fullMoveNumber)) return FEN_BAD_CLOCKS;
+            if (!fullMoveNumber) fullMoveNumber = 1;
+            fieldsEnd = c;
+        }
+    }
+    c = fieldsEnd;
+    if (c != end && *c != ' ' && *c != '\t' && *c != ';' && *c != '\r' && *c != '\n' && *c != '\0') return FEN_TRAILING_TEXT;
+
+    // The side to move mustn't be able to take the other king
+    int self = side * 7, them = !side;
+    unsigned long long int king = pieceBB[7 - self + 6];
+    int kingSquareIndex = bitScanForward(king);
+    if ((squaresSeen(~occupied, king, 1, them) & pieceBB[self + 1])
+        | (squaresSeen(~occupied, king, 2, them) & pieceBB[self + 2])
+        | (bishopAttacks(kingSquareIndex, occupied) & (pieceBB[self + 3] | pieceBB[self + 5]))
+        | (rookAttacks(kingSquareIndex, occupied) & (pieceBB[self + 4] | pieceBB[self + 5]))
+        | (kingAttacks(king) & pieceBB[self + 6])) {
+        return FEN_KING_CAPTURABLE;
+    }
+
+    // Valid, now the board can change
+    memcpy(board->pieceBB, pieceBB, sizeof(pieceBB));
+    board->occupiedBB = occupied;
+    board->emptyBB = ~occupied;
+    memcpy(board->boardBySquare, boardBySquare, sizeof(boardBySquare));
+    memcpy(board->castlingRights, castlingRights, sizeof(castlingRights));
+    board->epSquare = epSquare;
+    board->halfMoveClock = halfMoveClock;
+    board->fullMoveNumber = fullMoveNumber;
+    board->playerToMove = side;
+    board->history.length = 0;
+    board->zobristKey = key ^ zobristCastling[castlingIndex(board)] ^ ((epSquare) ? zobristEpFile[epFile(epSquare)] : 0)
+        ^ ((side) ? zobristSide : 0);
+    board->pawnKey = computePawnKey(board);
+    board->scoreMg = scoreMg;
+    board->scoreEg = scoreEg;
+    board->phase = phase;
+    // The accumulator has to be built from scratch, which does the scores again too
+    if (network.isLoaded) computePieceScores(board);
+    if (fenEnd != NULL) *fenEnd = c;
+    return FEN_OK;
+}
+
+// Sets up the board from the FEN string. If it isn't a valid position the board stays as it was and the
+// reason is printed. Anything after the FEN, like the moves of a UCI position command, is ignored.
+bool readFenStringToBoard(char *fenString, Board *board) {
+    int error = parseFen(board, fenString, fenString + strlen(fenString), NULL);
+    if (error != FEN_OK) printf("invalid FEN: %s\n", fenErrorText(error));
+    return error == FEN_OK;
+}
+
+static inline char* writeFenNumber(char *out, unsigned int value) {
+    char digits[10];
+    int count = 0;
+    do digits[count++] = '0' + value % 10; while (value /= 10);
+    while (count) *out++ = digits[--count];
+    return out;
+}
+
+// Writes the board's FEN into buffer, terminated. Returns its length, or -1 if size is less than FEN_BUFFER_SIZE.
+int writeFen(Board *board, char *buffer, size_t size) {
+    static const char symbols[2][8] = { "_PNBRQK", "_pnbrqk" };
+    if (size < FEN_BUFFER_SIZE) return -1;
+    char* out = buffer;
+    for (int rank = 7; rank >= 0; rank--) {
+        int emptyCount = 0;
+        for (int squareIndex = rank * 8 + 7; squareIndex >= rank * 8; squareIndex--) {
+            int piece = board->boardBySquare[squareIndex];
+            if (!piece) {
+                emptyCount++;
+                continue;
+            }
+            if (emptyCount) *out++ = '0' + emptyCount;
+            emptyCount = 0;
+            *out++ = symbols[(board->pieceBB[7] >> squareIndex) & 1][piece];
+        }
+        if (emptyCount) *out++ = '0' + emptyCount;
+        if (rank) *out++ = '/';
+    }
+    *out++ = ' ';
+    *out++ = (board->playerToMove) ? 'b' : 'w';
+    *out++ = ' ';
+    if (board->castlingRights[0]) *out++ = 'K';
+    if (board->castlingRights[1]) *out++ = 'Q';
+    if (board->castlingRights[2]) *out++ = 'k';
+    if (board->castlingRights[3]) *out++ = 'q';
+    if (out[-1] == ' ') *out++ = '-';
+    *out++ = ' ';
+    if (board->epSquare) {
+        int epSquareIndex = bitScanForward(board->epSquare);
+        *out++ = 'h' - (epSquareIndex % 8);
+        *out++ = '1' + (epSquareIndex / 8);
+    }
+    else *out++ = '-';
+    *out++ = ' ';
+    out = writeFenNumber(out, (unsigned int)board->halfMoveClock);
+    *out++ = ' ';
+    out = writeFenNumber(out, (unsigned int)board->fullMoveNumber);
+    *out = '\0';
+    return (int)(out - buffer);
+}
+
+void printBoard(int showFEN, int showBoard, Board *board) {
+    char fen[FEN_BUFFER_SIZE];
+    writeFen(board, fen, sizeof(fen));
+    if (showFEN) printf("FEN: %s\n", fen);
+    if (!showBoard) return;
+
+    printf("To move: %s\n-------------------------------------------------\n", (board->playerToMove)? "black" : "white");
+    for (char* c = fen; *c != ' '; c++) {
+        if (*c == '/') printf("|\n-------------------------------------------------\n");
+        else if (isdigit(*c)) for (int i = 0; i < *c - '0'; i++) printf("|     ");
+        else printf("|  %c  ", *c);
+    }
+    printf("|\n-------------------------------------------------\n");
+}
+
+// Reads the positions of a FEN or EPD file one line at a time, out of a read only mapping of the whole file.
+// Blank lines are skipped. Whatever follows the FEN on a line, EPD operations for instance, is left for the caller
+// between operations and lineEnd, which point into the mapping like fen does.
+typedef struct {
+    const char* data;
+    size_t size;
+    const char* next; // start of the line after the current one
+    unsigned long long int line; // number of the current line, from 1
+    const char* fen;
+    const char* operations;
+    const char* lineEnd;
+} FenReader;
+
+// False if the file can't be opened or mapped, which an empty file can't be either
+bool openFenReader(FenReader *reader, const char *path) {
+    memset(reader, 0, sizeof(FenReader));
+    reader->data = (const char*)mapFile(path, &reader->size);
+    reader->next = reader->data;
+    return reader->data != NULL;
+}
+
+void closeFenReader(FenReader *reader) {
+    if (reader->data != NULL) unmapFile(reader->data, reader->size);
+    reader->data = NULL;
+}
+
+// Parses the next position into board. Returns FEN_OK, FEN_END once the file runs out, or what's wrong with the
+// line, which is then passed over with the board left as it was.
+int readNextFen(FenReader *reader, Board *board) {
+    const char* end = reader->data + reader->size;
+    while (reader->next < end) {
+        const char* start = reader->next;
+        const char* lineEnd = (const char*)memchr(start, '\n', end - start);
+        if (lineEnd == NULL) lineEnd = end;
+        reader->next = (lineEnd < end) ? lineEnd + 1 : end;
+        reader->line++;
+        if (lineEnd > start && lineEnd[-1] == '\r') lineEnd--;
+        while (start < lineEnd && (*start == ' ' || *start == '\t')) start++;
+        if (start == lineEnd) continue;
+
+        reader->fen = start;
+        reader->lineEnd = lineEnd;
+        reader->operations = lineEnd;
+        int error = parseFen(board, start, lineEnd, &reader->operations);
+        while (reader->operations < lineEnd && (*reader->operations == ' ' || *reader->operations == '\t')) reader->operations++;
+        return error;
+    }
+    return FEN_END;
+}
+
+// fencheck <file>. Parses every position in the file, prints the lines that aren't valid and how fast it went.
+void checkFenFile(Board *board, const char *path) {
+    FenReader reader;
+    if (!openFenReader(&reader, path)) {
+        printf("couldn't read %s\n", path);
+        return;
+    }
+    unsigned long long int positions = 0, errors = 0, start = getTimeMicroseconds();
+    int error;
+    while ((error = readNextFen(&reader, board)) != FEN_END) {
+        if (error == FEN_OK) {
+            positions++;
+            continue;
+        }
+        if (errors++ < 10) printf("line %llu: %s\n", reader.line, fenErrorText(error));
+    }
+    unsigned long long int microseconds = getTimeMicroseconds() - start;
+    closeFenReader(&reader);
+    printf("positions: %llu\ninvalid lines: %llu\ntime: %llu ms\npositions per second: %llu\n", positions, errors,
+        microseconds / 1000, (microseconds) ? (positions + errors) * 1000000 / microseconds : 0);
+}
+
+void showAvailableMoves(Board *board) {
+    MoveBuffer moves;
+    moves.length = 0;
+    char moveText[6] = {'\0'};
+
+    generateMoves(&moves, board);
+    for (int i = 0; i < moves.length; i++) {
+        moveToText(moveText, moves.moves[i]);
+        printf("%d. %s\n", i + 1, moveText);
+    }
+}
+
+unsigned long long int perft(Board *board, int depth) {
+    // Finishes depth of 7 in about 7 minutes from starting position, with results that match stockfish.
+
+    if (depth == 0) return 1;
+    unsigned long long int count = 0;
+    // Leaf nodes only need the number of moves, not the moves themselves
+    if (depth == 1) return countLegalMoves(board);
+    MoveBuffer legalMoves;
+    legalMoves.length = 0;
+    generateMoves(&legalMoves, board);
+
+    for (int i = 0; i < legalMoves.length; i++) {
+        makeMove(board, legalMoves.moves[i]);
+        count += perft(board, depth - 1);
+        unmakeMove(board, legalMoves.moves[i]);
+    }
+    return count;
+}
+
+// Sizes the table to the largest power of two number of buckets that fits in megabytes
+bool initPerftTable(PerftTable *table, unsigned long long int megabytes) {
+    unsigned long long int bucketCount = 1;
+    while (bucketCount * 2 * sizeof(PerftBucket) <= megabytes * 1024 * 1024) bucketCount *= 2;
+    table->buckets = (PerftBucket*)alignedAlloc(bucketCount * sizeof(PerftBucket), 64);
+    if (table->buckets == NULL) return false;
+    memset(table->buckets, 0, bucketCount * sizeof(PerftBucket));
+    table->bucketMask = bucketCount - 1;
+    table->probes = 0;
+    table->hits = 0;
+    return true;
+}
+
+void destroyPerftTable(PerftTable *table) {
+    alignedFree(table->buckets);
+}
+
+unsigned long long int perftHashed(Board *board, int depth, PerftTable *table) {
+    if (depth == 0) return 1;
+    if (depth == 1) return perft(board, 1); // not worth a probe, generating the moves is as cheap as the lookup
+
+    PerftBucket* bucket = &table->buckets[board->zobristKey & table->bucketMask];
+    table->probes++;
+    for (int i = 0; i < 4; i++) {
+        unsigned long long int data = bucket->entries[i].data;
+        if ((bucket->entries[i].key ^ data) == board->zobristKey && (int)(data & 0xFF) == depth) {
+            table->hits++;
+            return data >> 8;
+        }
+    }
+
+    unsigned long long int count = 0;
+    MoveBuffer legalMoves;
+    legalMoves.length = 0;
+    generateMoves(&legalMoves, board);
+    for (int i = 0; i < legalMoves.length; i++) {
+        makeMove(board, legalMoves.moves[i]);
+        count += perftHashed(board, depth - 1, table);
+        unmakeMove(board, legalMoves.moves[i]);
+    }
+
+    // Replace the shallowest entry, deeper ones save more work when they hit
+    int replace = 0;
+    for (int i = 1; i < 4; i++) {
+        if ((bucket->entries[i].data & 0xFF) < (bucket->entries[replace].data & 0xFF)) replace = i;
+    }
+    unsigned long long int data = (count << 8) | depth;
+    bucket->entries[replace].key = board->zobristKey ^ data;
+    bucket->entries[replace].data = data;
+    return count;
+}
+
+void printPerftStats(unsigned long long int nodes, unsigned long long int microseconds, PerftTable *table) {
+    printf("time: %llu ms\nnps: %llu\n", microseconds / 1000, (microseconds) ? nodes * 1000000 / microseconds : 0);
+    if (table != NULL) {
+        printf("hash hits: %llu of %llu probes (%.1f%%)\n", table->hits, table->probes,
+            (table->probes) ? 100.0 * table->hits / table->probes : 0.0);
+    }
+}
+
+// Copies a board, giving the copy its own undo stack so the two can be played on independently
+void copyBoard(Board *dst, Board *src) {
+    memcpy(dst, src, sizeof(Board));
+    initUndoStack(&(dst->history), src->history.capacity);
+    memcpy(dst->history.entries, src->history.entries, src->history.length * sizeof(Undo));
+    dst->history.length = src->history.length;
+}
+
+// Parallel perft. The tree is cut into tasks of up to MAX_SPLIT_PLY moves from the root, each worker
+// plays its tasks on its own copy of the board. Tasks are dealt out to per worker deques, a worker takes
+// from the bottom of its own deque and steals from the top of the others' once it runs dry.
+#define MAX_SPLIT_PLY 3
+
+typedef struct {
+    Move moves[MAX_SPLIT_PLY];
+    int moveCount;
+    int rootIndex;
+    unsigned long long int count;
+} PerftTask;
+
+typedef struct {
+    int* taskIndexes;
+    int top;
+    int bottom;
+    Mutex lock;
+} WorkDeque;
+
+typedef struct {
+    PerftTask* tasks;
+    int taskCount;
+    WorkDeque* deques;
+    int threadCount;
+    int depth;
+} PerftJob;
+
+typedef struct {
+    Board board;
+    PerftTable table; // shares buckets with the other workers but counts its own hits
+    bool useTable;
+    int id;
+    PerftJob* job;
+} PerftWorker;
+
+bool takeTask(PerftJob *job, int id, int *taskIndex) {
+    WorkDeque* own = &job->deques[id];
+    lockMutex(&own->lock);
+    if (own->bottom > own->top) {
+        *taskIndex = own->taskIndexes[--own->bottom];
+        unlockMutex(&own->lock);
+        return true;
+    }
+    unlockMutex(&own->lock);
+
+    for (int i = 1; i < job->threadCount; i++) {
+        WorkDeque* victim = &job->deques[(id + i) % job->threadCount];
+        lockMutex(&victim->lock);
+        if (victim->bottom > victim->top) {
+            *taskIndex = victim->taskIndexes[victim->top++];
+            unlockMutex(&victim->lock);
+            return true;
+        }
+        unlockMutex(&victim->lock);
+    }
+    // Nothing creates tasks once the workers start, so empty deques everywhere means the job is done
+    return false;
+}
+
+THREAD_FUNCTION(perftWorker, lpParameter) {
+    PerftWorker* worker = (PerftWorker*)lpParameter;
+    PerftJob* job = worker->job;
+    int taskIndex;
+
+    while (takeTask(job, worker->id, &taskIndex)) {
+        PerftTask* task = &job->tasks[taskIndex];
+        for (int i = 0; i < task->moveCount; i++) makeMove(&worker->board, task->moves[i]);
+        task->count = (worker->useTable)
+            ? perftHashed(&worker->board, job->depth - task->moveCount, &worker->table)
+            : perft(&worker->board, job->depth - task->moveCount);
+        for (int i = task->moveCount - 1; i >= 0; i--) unmakeMove(&worker->board, task->moves[i]);
+    }
+    flushStats();
+    return THREAD_RETURN;
+}
+
+// Replaces every task with one task per legal move after it. Tasks with no legal moves are dropped,
+// they contribute nothing to the count. False, leaving the tasks as they were, if there isn't the memory.
+bool splitPerftTasks(Board *board, PerftTask **tasks, int *taskCount) {
+    int capacity = *taskCount * 40, newCount = 0;
+    PerftTask* split = (PerftTask*)malloc(capacity * sizeof(PerftTask));
+    if (split == NULL) return false;
+    MoveBuffer legalMoves;
+    legalMoves.length = 0;
+
+    for (int i = 0; i < *taskCount; i++) {
+        PerftTask* task = &(*tasks)[i];
+        for (int j = 0; j < task->moveCount; j++) makeMove(board, task->moves[j]);
+        legalMoves.length = 0;
+        generateMoves(&legalMoves, board);
+        for (int j = task->moveCount - 1; j >= 0; j--) unmakeMove(board, task->moves[j]);
+
+        if (newCount + legalMoves.length > capacity) {
+            capacity = (newCount + legalMoves.length) * 2;
+            PerftTask* temp = (PerftTask*)realloc(split, capacity * sizeof(PerftTask));
+            if (temp == NULL) {
+                free(split);
+                return false;
+            }
+            split = temp;
+        }
+        for (int j = 0; j < legalMoves.length; j++) {
+            split[newCount] = *task;
+            split[newCount].moves[task->moveCount] = legalMoves.moves[j];
+            split[newCount].moveCount++;
+            newCount++;
+        }
+    }
+    free(*tasks);
+    *tasks = split;
+    *taskCount = newCount;
+    return true;
+}
+
+// perft() one root move at a time, for parallelPerft to fall back on
+unsigned long long int serialPerft(Board *board, int depth, PerftTable *table, unsigned long long int *rootCounts) {
+    MoveBuffer rootMoves;
+    rootMoves.length = 0;
+    generateMoves(&rootMoves, board);
+    unsigned long long int count = 0;
+    for (int i = 0; i < rootMoves.length; i++) {
+        makeMove(board, rootMoves.moves[i]);
+        unsigned long long int subCount = (table != NULL) ? perftHashed(board, depth - 1, table) : perft(board, depth - 1);
+        unmakeMove(board, rootMoves.moves[i]);
+        if (rootCounts != NULL) rootCounts[i] = subCount;
+        count += subCount;
+    }
+    return count;
+}
+
+// Returns the same count as perft(), and fills rootCounts (if given) with the count under each root move
+// in the order generateMoves() gives them. Without the memory for the job it counts on this thread alone.
+unsigned long long int parallelPerft(Board *board, int depth, int threadCount, PerftTable *table, unsigned long long int *rootCounts) {
+    PerftJob job;
+    MoveBuffer rootMoves;
+    rootMoves.length = 0;
+    generateMoves(&rootMoves, board);
+
+    job.depth = depth;
+    job.threadCount = threadCount;
+    job.taskCount = rootMoves.length;
+    job.tasks = (PerftTask*)malloc((rootMoves.length + 1) * sizeof(PerftTask));
+    if (job.tasks == NULL) return serialPerft(board, depth, table, rootCounts);
+    for (int i = 0; i < rootMoves.length; i++) {
+        job.tasks[i].moves[0] = rootMoves.moves[i];
+        job.tasks[i].moveCount = 1;
+        job.tasks[i].rootIndex = i;
+        if (rootCounts != NULL) rootCounts[i] = 0;
+    }
+    // Few root moves or many threads, split deeper so there are enough tasks to balance. Leave at least
+    // two plies to each task so the bookkeeping stays small next to the work.
+    // A split that runs out of memory leaves the tasks as they were, which still covers the whole tree.
+    for (int ply = 1; ply < MAX_SPLIT_PLY && job.taskCount < threadCount * 8 && depth - ply > 2; ply++) {
+        if (!splitPerftTasks(board, &job.tasks, &job.taskCount)) break;
+    }
+
+    // Deal the tasks out round robin
+    job.deques = (WorkDeque*)calloc(threadCount, sizeof(WorkDeque));
+    PerftWorker* workers = (PerftWorker*)malloc(threadCount * sizeof(PerftWorker));
+    Thread* threads = (Thread*)malloc(threadCount * sizeof(Thread));
+    bool* started = (bool*)malloc(threadCount * sizeof(bool));
+    bool isAllocated = job.deques != NULL && workers != NULL && threads != NULL && started != NULL;
+    for (int i = 0; isAllocated && i < threadCount; i++) {
+        job.deques[i].taskIndexes = (int*)malloc((job.taskCount / threadCount + 1) * sizeof(int));
+        isAllocated = job.deques[i].taskIndexes != NULL;
+    }
+    if (!isAllocated) {
+        for (int i = 0; job.deques != NULL && i < threadCount; i++) free(job.deques[i].taskIndexes);
+        free(threads);
+        free(started);
+        free(workers);
+        free(job.deques);
+        free(job.tasks);
+        return serialPerft(board, depth, table, rootCounts);
+    }
+    for (int i = 0; i < threadCount; i++) {
+        job.deques[i].top = 0;
+        job.deques[i].bottom = 0;
+        initMutex(&job.deques[i].lock);
+    }
+    for (int i = 0; i < job.taskCount; i++) {
+        WorkDeque* deque = &job.deques[i % threadCount];
+        deque->taskIndexes[deque->bottom++] = i;
+    }
+
+    for (int i = 0; i < threadCount; i++) {
+        copyBoard(&workers[i].board, board);
+        workers[i].useTable = table != NULL;
+        if (table != NULL) {
+            workers[i].table = *table;
+            workers[i].table.probes = 0;
+            workers[i].table.hits = 0;
+        }
+        workers[i].id = i;
+        workers[i].job = &job;
+        started[i] = startThread(&threads[i], perftWorker, &workers[i]);
+        if (!started[i]) {
+            // Run the worker on this thread instead, the others will steal from it
+            perftWorker(&workers[i]);
+        }
+    }
+
+    unsigned long long int count = 0;
+    for (int i = 0; i < threadCount; i++) {
+        if (started[i]) joinThread(threads[i]);
+        if (table != NULL) {
+            table->probes += workers[i].table.probes;
+            table->hits += workers[i].table.hits;
+        }
+        destroyUndoStack(&(workers[i].board.history));
+        destroyMutex(&job.deques[i].lock);
+        free(job.deques[i].taskIndexes);
+    }
+    for (int i = 0; i < job.taskCount; i++) {
+        count += job.tasks[i].count;
+        if (rootCounts != NULL) rootCounts[job.tasks[i].rootIndex] += job.tasks[i].count;
+    }
+
+    free(threads);
+    free(started);
+    free(workers);
+    free(job.deques);
+    free(job.tasks);
+    return count;
+}
+
+unsigned long long int divide(Board *board, int depth, PerftTable *table, int threadCount) {
+    if (depth == 0) return 0;
+    MoveBuffer legalMoves;
+    legalMoves.length = 0;
+    generateMoves(&legalMoves, board);
+    unsigned long long int posCount = 0, subCount;
+    unsigned long long int* rootCounts = NULL;
+
+    // With more than one thread every subtree is counted up front, then printed in the same format
+    if (threadCount > 1 && depth > 1) {
+        rootCounts = (unsigned long long int*)malloc((legalMoves.length + 1) * sizeof(unsigned long long int));
+        parallelPerft(board, depth, threadCount, table, rootCounts);
+    }
+
+    for (int i = 0; i < legalMoves.length; i++) {
+        char moveText[6] = { '\0' };
+        moveToText(moveText, legalMoves.moves[i]);
+        printf("%s - ", moveText);
+        if (rootCounts != NULL) {
+            subCount = rootCounts[i];
+        }
+        else {
+            makeMove(board, legalMoves.moves[i]);
+            subCount = (table != NULL) ? perftHashed(board, depth - 1, table) : perft(board, depth - 1);
+            unmakeMove(board, legalMoves.moves[i]);
+        }
+        posCount += subCount;
+        printf("%llu\n", subCount);
+    }
+    free(rootCounts);
+    printf("moves: %d\npositions: %llu\n", legalMoves.length, posCount);
+    return posCount;
+}
+
+// Perft regression suite. Each line of an EPD file is a FEN (four or six fields) followed by the expected counts,
+// as in "<FEN> ;D1 20 ;D2 400". Positions are shared out over the threads, each running perft() on its own board,
+// and the results are written as JSON once all are done. When a count is wrong the first root move whose subtree
+// disagrees with referencePerft() is followed down to the position where the two part ways. If the two agree the
+// divergence is null, which means the expected count, or a bug both generators share, is the thing to look at.
+#define MAX_SUITE_DEPTHS 16
+
+// The reference move generator. It shares nothing with the real one but the board and makeMove: it walks the
+// squares by file and rank, the way a person would, finds attacks the same way, and tries every move it finds by
+// playing it, so a move the real generator leaves out shows up as a difference rather than in neither count.
+static const int referenceKnightSteps[8][2] = { {1, 2}, {2, 1}, {2, -1}, {1, -2}, {-1, -2}, {-2, -1}, {-2, 1}, {-1, 2} };
+static const int referenceKingSteps[8][2] = { {1, 0}, {1, 1}, {0, 1}, {-1, 1}, {-1, 0}, {-1, -1}, {0, -1}, {1, -1} };
+// Diagonals first, then files and ranks
+static const int referenceSlides[8][2] = { {1, 1}, {1, -1}, {-1, 1}, {-1, -1}, {1, 0}, {-1, 0}, {0, 1}, {0, -1} };
+
+// Square index of a file (0 is a) and rank (0 is the first), -1 if that's off the board
+static int referenceSquare(int file, int rank) {
+    return (file < 0 || file > 7 || rank < 0 || rank > 7) ? -1 : 8 * rank + 7 - file;
+}
+
+// Colour of the piece on a square, -1 if it's empty
+static int referenceColor(Board *board, int square) {
+    if (!board->boardBySquare[square]) return -1;
+    return (board->pieceBB[7] >> square) & 1;
+}
+
+static bool referenceHasPiece(Board *board, int square, int piece, int color) {
+    return square >= 0 && board->boardBySquare[square] == piece && referenceColor(board, square) == color;
+}
+
+// Whether any piece of color attacks square
+static bool referenceAttacked(Board *board, int square, int color) {
+    int file = 7 - (square & 7), rank = square >> 3;
+    for (int i = 0; i < 8; i++) {
+        if (referenceHasPiece(board, referenceSquare(file + referenceKnightSteps[i][0], rank + referenceKnightSteps[i][1]), 2, color)) return true;
+        if (referenceHasPiece(board, referenceSquare(file + referenceKingSteps[i][0], rank + referenceKingSteps[i][1]), 6, color)) return true;
+    }
+    // White pawns attack from the rank below, black ones from the rank above
+    int pawnRank = rank + ((color) ? 1 : -1);
+    if (referenceHasPiece(board, referenceSquare(file - 1, pawnRank), 1, color)) return true;
+    if (referenceHasPiece(board, referenceSquare(file + 1, pawnRank), 1, color)) return true;
+    for (int i = 0; i < 8; i++) {
+        int f = file, r = rank, from;
+        do {
+            f += referenceSlides[i][0];
+            r += referenceSlides[i][1];
+            from = referenceSquare(f, r);
+        } while (from >= 0 && !board->boardBySquare[from]);
+        if (from < 0 || referenceColor(board, from) != color) continue;
+        if (board->boardBySquare[from] == 5 || board->boardBySquare[from] == ((i < 4) ? 3 : 4)) return true;
+    }
+    return false;
+}
+
+static void referencePawnMove(MoveBuffer *moves, int from, int to, bool isCapture, bool isPromotion) {
+    if (!isPromotion) {
+        pushMove(moves, formMove(from, to, isCapture, false, false, false));
+        return;
+    }
+    // Knight, bishop, rook, queen
+    for (int kind = 0; kind < 4; kind++) pushMove(moves, formMove(from, to, isCapture, true, kind >> 1, kind & 1));
+}
+
+// Every move of the side to move, legal or not, except castling out of or through check
+static void referencePseudoLegalMoves(Board *board, MoveBuffer *moves) {
+    int color = board->playerToMove, enemy = !color;
+    int forward = (color) ? -1 : 1, startRank = (color) ? 6 : 1, lastRank = (color) ? 0 : 7;
+    moves->length = 0;
+    for (int from = 0; from < 64; from++) {
+        if (referenceColor(board, from) != color) continue;
+        int piece = board->boardBySquare[from], file = 7 - (from & 7), rank = from >> 3;
+        if (piece == 1) {
+            int to = referenceSquare(file, rank + forward);
+            if (to >= 0 && !board->boardBySquare[to]) {
+                referencePawnMove(moves, from, to, false, rank + forward == lastRank);
+                int twoAhead = referenceSquare(file, rank + 2 * forward);
+                if (rank == startRank && !board->boardBySquare[twoAhead]) {
+                    pushMove(moves, formMove(from, twoAhead, false, false, false, true));
+                }
+            }
+            for (int side = -1; side <= 1; side += 2) {
+                to = referenceSquare(file + side, rank + forward);
+                if (to < 0) continue;
+                if (referenceColor(board, to) == enemy) referencePawnMove(moves, from, to, true, rank + forward == lastRank);
+                else if (board->epSquare == 1ULL << to) pushMove(moves, formMove(from, to, true, false, true, false));
+            }
+        }
+        else if (piece == 2 || piece == 6) {
+            const int (*steps)[2] = (piece == 2) ? referenceKnightSteps : referenceKingSteps;
+            for (int i = 0; i < 8; i++) {
+                int to = referenceSquare(file + steps[i][0], rank + steps[i][1]);
+                if (to >= 0 && referenceColor(board, to) != color) {
+                    pushMove(moves, formMove(from, to, board->boardBySquare[to] != 0, false, false, false));
+                }
+            }
+        }
+        else {
+            // Bishops go along the first four directions, rooks the last four, queens all eight
+            int first = (piece == 4) ? 4 : 0, last = (piece == 3) ? 4 : 8;
+            for (int i = first; i < last; i++) {
+                int f = file + referenceSlides[i][0], r = rank + referenceSlides[i][1], to;
+                while ((to = referenceSquare(f, r)) >= 0 && referenceColor(board, to) != color) {
+                    pushMove(moves, formMove(from, to, board->boardBySquare[to] != 0, false, false, false));
+                    if (board->boardBySquare[to]) break;
+                    f += referenceSlides[i][0];
+                    r += referenceSlides[i][1];
+                }
+            }
+        }
+    }
+
+    // Castling needs the right, the rook at home, nothing in between and the king not in check or passing one.
+    // Whether it lands in check is left to the legality test like any other move.
+    int base = (color) ? 56 : 0, king = base + 3;
+    if (board->castlingRights[2 * color] && referenceHasPiece(board, king, 6, color) && referenceHasPiece(board, base, 4, color)
+        && !board->boardBySquare[base + 1] && !board->boardBySquare[base + 2]
+        && !referenceAttacked(board, king, enemy) && !referenceAttacked(board, base + 2, enemy)) {
+        pushMove(moves, formMove(king, base + 1, false, false, true, false));
+    }
+    if (board->castlingRights[2 * color + 1] && referenceHasPiece(board, king, 6, color) && referenceHasPiece(board, base + 7, 4, color)
+        && !board->boardBySquare[base + 4] && !board->boardBySquare[base + 5] && !board->boardBySquare[base + 6]
+        && !referenceAttacked(board, king, enemy) && !referenceAttacked(board, base + 4, enemy)) {
+        pushMove(moves, formMove(king, base + 5, false, false, true, true));
+    }
+}
+
+// The pseudo-legal moves that don't leave the mover's king attacked
+void referenceLegalMoves(Board *board, MoveBuffer *moves) {
+    MoveBuffer candidates;
+    referencePseudoLegalMoves(board, &candidates);
+    int mover = board->playerToMove;
+    moves->length = 0;
+    for (int i = 0; i < candidates.length; i++) {
+        STAT_INC(trialMoves);
+        makeMove(board, candidates.moves[i]);
+        if (!referenceAttacked(board, bitScanForward(board->pieceBB[7 * mover + 6]), !mover)) pushMove(moves, candidates.moves[i]);
+        unmakeMove(board, candidates.moves[i]);
+    }
+}
+
+// Slow perft to check perft() against, on the reference generator
+unsigned long long int referencePerft(Board *board, int depth) {
+    if (depth == 0) return 1;
+    MoveBuffer moves;
+    referenceLegalMoves(board, &moves);
+    if (depth == 1) return moves.length;
+    unsigned long long int count = 0;
+    for (int i = 0; i < moves.length; i++) {
+        makeMove(board, moves.moves[i]);
+        count += referencePerft(board, depth - 1);
+        unmakeMove(board, moves.moves[i]);
+    }
+    return count;
+}
+
+static bool moveListHas(MoveBuffer *moves, Move move) {
+    for (int i = 0; i < moves->length; i++) {
+        if (moves->moves[i] == move) return true;
+    }
+    return false;
+}
+
+typedef struct {
+    char fen[FEN_BUFFER_SIZE];
+    int depthCount;
+    int depths[MAX_SUITE_DEPTHS];
+    unsigned long long int expected[MAX_SUITE_DEPTHS];
+    unsigned long long int nodes[MAX_SUITE_DEPTHS];
+    unsigned long long int microseconds[MAX_SUITE_DEPTHS];
+    bool passed;
+    // Where perft() and the reference disagree, if a count was wrong and they do, and the moves there that only the
+    // reference finds and only generateMoves() does
+    bool hasDivergence;
+    Move line[MAX_PLY];
+    int lineLength;
+    char divergenceFen[FEN_BUFFER_SIZE];
+    int divergenceDepth;
+    unsigned long long int divergenceNodes;
+    unsigned long long int divergenceReference;
+    MoveBuffer missing;
+    MoveBuffer extra;
+} SuitePosition;
+
+typedef struct {
+    SuitePosition* positions;
+    int positionCount;
+    int nextPosition;
+    int maxDepth;
+    Mutex lock;
+} PerftSuite;
+
+// Follows the first move whose subtree perft() and the reference count differently, as long as there is one.
+// It stops where the two generators don't agree on the moves themselves.
+void findDivergence(Board *board, int depth, SuitePosition *position) {
+    position->divergenceNodes = perft(board, depth);
+    position->divergenceReference = referencePerft(board, depth);
+    if (position->divergenceNodes == position->divergenceReference) return;
+    position->hasDivergence = true;
+    position->divergenceDepth = depth;
+
+    MoveBuffer moves, reference;
+    moves.length = 0;
+    generateMoves(&moves, board);
+    referenceLegalMoves(board, &reference);
+    position->missing.length = 0;
+    position->extra.length = 0;
+    for (int i = 0; i < reference.length; i++) {
+        if (!moveListHas(&moves, reference.moves[i])) pushMove(&position->missing, reference.moves[i]);
+    }
+    for (int i = 0; i < moves.length; i++) {
+        if (!moveListHas(&reference, moves.moves[i])) pushMove(&position->extra, moves.moves[i]);
+    }
+    if (depth > 1 && !position->missing.length && !position->extra.length) {
+        for (int i = 0; i < moves.length; i++) {
+            makeMove(board, moves.moves[i]);
+            bool differs = perft(board, depth - 1) != referencePerft(board, depth - 1);
+            if (differs) {
+                position->line[position->lineLength++] = moves.moves[i];
+                findDivergence(board, depth - 1, position);
+            }
+            unmakeMove(board, moves.moves[i]);
+            if (differs) return;
+        }
+    }
+    // No single move's subtree is off, the move list or the count of it here is
+    writeFen(board, position->divergenceFen, sizeof(position->divergenceFen));
+}
+
+void runSuitePosition(Board *board, SuitePosition *position, int maxDepth) {
+    // readPerftSuite only keeps positions that parsed
+    parseFen(board, position->fen, position->fen + strlen(position->fen), NULL);
+    position->passed = true;
+    for (int i = 0; i < position->depthCount; i++) {
+        if (position->depths[i] > maxDepth || position->depths[i] > MAX_PLY) {
+            position->nodes[i] = 0;
+            position->microseconds[i] = 0;
+            continue;
+        }
+        unsigned long long int start = getTimeMicroseconds();
+        position->nodes[i] = perft(board, position->depths[i]);
+        position->microseconds[i] = getTimeMicroseconds() - start;
+        if (position->nodes[i] != position->expected[i]) {
+            if (position->passed) findDivergence(board, position->depths[i], position);
+            position->passed = false;
+        }
+    }
+}
+
+THREAD_FUNCTION(perftSuiteWorker, lpParameter) {
+    PerftSuite* suite = (PerftSuite*)lpParameter;
+    Board board;
+    char pieceSymbols[15];
+    initBoardState(&board, pieceSymbols);
+    while (true) {
+        lockMutex(&suite->lock);
+        int index = suite->nextPosition++;
+        unlockMutex(&suite->lock);
+        if (index >= suite->positionCount) break;
+        runSuitePosition(&board, &suite->positions[index], suite->maxDepth);
+    }
+    destroyUndoStack(&(board.history));
+    flushStats();
+    return THREAD_RETURN;
+}
+
+// Reads the positions out of the file, false if it can't be opened. Lines without counts are skipped, lines with
+// an invalid FEN are reported on stderr and skipped too. The FENs are kept as writeFen puts them, clocks included.
+bool readPerftSuite(const char *path, PerftSuite *suite) {
+    FenReader reader;
+    if (!openFenReader(&reader, path)) return false;
+    Board board;
+    char pieceSymbols[15];
+    initBoardState(&board, pieceSymbols);
+    char operations[1024];
+    int capacity = 64, error;
+    suite->positions = (SuitePosition*)malloc(capacity * sizeof(SuitePosition));
+    suite->positionCount = 0;
+    while (suite->positions != NULL && (error = readNextFen(&reader, &board)) != FEN_END) {
+        if (error != FEN_OK) {
+            fprintf(stderr, "%s line %llu: %s\n", path, reader.line, fenErrorText(error));
+            continue;
+        }
+        // The counts are read with sscanf, which needs them terminated
+        size_t length = reader.lineEnd - reader.operations;
+        if (length >= sizeof(operations)) length = sizeof(operations) - 1;
+        memcpy(operations, reader.operations, length);
+        operations[length] = '\0';
+        char* counts = strchr(operations, ';');
+        if (counts == NULL) continue;
+        if (suite->positionCount == capacity) {
+            SuitePosition* positions = (SuitePosition*)realloc(suite->positions, capacity * 2 * sizeof(SuitePosition));
+            if (positions == NULL) break;
+            suite->positions = positions;
+            capacity *= 2;
+        }
+        SuitePosition* position = &suite->positions[suite->positionCount];
+        memset(position, 0, sizeof(SuitePosition));
+        writeFen(&board, position->fen, sizeof(position->fen));
+
+        while (counts != NULL && position->depthCount < MAX_SUITE_DEPTHS) {
+            int depth;
+            unsigned long long int expected;
+            if (sscanf(counts, ";D%d %llu", &depth, &expected) == 2) {
+                position->depths[position->depthCount] = depth;
+                position->expected[position->depthCount++] = expected;
+            }
+            counts = strchr(counts + 1, ';');
+        }
+        if (position->depthCount) suite->positionCount++;
+    }
+    closeFenReader(&reader);
+    destroyUndoStack(&(board.history));
+    return suite->positions != NULL;
+}
+
+void printJsonString(FILE *out, const char *text) {
+    fputc('"', out);
+    for (; *text; text++) {
+        if (*text == '"' || *text == '\\') fputc('\\', out);
+        fputc(*text, out);
+    }
+    fputc('"', out);
+}
+
+void printJsonMoves(FILE *out, Move *moves, int count) {
+    char moveText[6];
+    fputc('[', out);
+    for (int i = 0; i < count; i++) {
+        moveToText(moveText, moves[i]);
+        fprintf(out, "%s\"%s\"", (i) ? ", " : "", moveText);
+    }
+    fputc(']', out);
+}
+
+void printPerftSuiteJson(FILE *out, const char *path, PerftSuite *suite, int threadCount, unsigned long long int microseconds) {
+    unsigned long long int totalNodes = 0;
+    int passed = 0;
+    fprintf(out, "{\n  \"file\": ");
+    printJsonString(out, path);
+    fprintf(out, ",\n  \"threads\": %d,\n  \"positions\": [\n", threadCount);
+    for (int i = 0; i < suite->positionCount; i++) {
+        SuitePosition* position = &suite->positions[i];
+        unsigned long long int nodes = 0, time = 0;
+        fprintf(out, "    {\n      \"index\": %d,\n      \"fen\": ", i + 1);
+        printJsonString(out, position->fen);
+        fprintf(out, ",\n      \"passed\": %s,\n      \"depths\": [\n", (position->passed) ? "true" : "false");
+        for (int j = 0; j < position->depthCount; j++) {
+            bool skipped = position->depths[j] > suite->maxDepth;
+            nodes += position->nodes[j];
+            time += position->microseconds[j];
+            fprintf(out, "        { \"depth\": %d, \"expected\": %llu, ", position->depths[j], position->expected[j]);
+            if (skipped) fprintf(out, "\"skipped\": true }");
+            else {
+                fprintf(out, "\"nodes\": %llu, \"passed\": %s, \"microseconds\": %llu, \"nps\": %llu }", position->nodes[j],
+                    (position->nodes[j] == position->expected[j]) ? "true" : "false", position->microseconds[j],
+                    (position->microseconds[j]) ? position->nodes[j] * 1000000 / position->microseconds[j] : 0);
+            }
+            fprintf(out, "%s\n", (j < position->depthCount - 1) ? "," : "");
+        }
+        fprintf(out, "      ],\n      \"microseconds\": %llu,\n      \"nps\": %llu,\n      \"divergence\": ", time, (time) ? nodes * 1000000 / time : 0);
+        if (position->hasDivergence) {
+            fprintf(out, "{ \"line\": ");
+            printJsonMoves(out, position->line, position->lineLength);
+            fprintf(out, ", \"fen\": ");
+            printJsonString(out, position->divergenceFen);
+            fprintf(out, ", \"depth\": %d, \"nodes\": %llu, \"reference\": %llu, \"missing\": ", position->divergenceDepth,
+                position->divergenceNodes, position->divergenceReference);
+            printJsonMoves(out, position->missing.moves, position->missing.length);
+            fprintf(out, ", \"extra\": ");
+            printJsonMoves(out, position->extra.moves, position->extra.length);
+            fprintf(out, " }");
+        }
+        else fprintf(out, "null");
+        fprintf(out, "\n    }%s\n", (i < suite->positionCount - 1) ? "," : "");
+        totalNodes += nodes;
+        passed += position->passed;
+    }
+    fprintf(out, "  ],\n  \"passed\": %d,\n  \"failed\": %d,\n  \"nodes\": %llu,\n  \"microseconds\": %llu,\n  \"nps\": %llu\n}\n",
+        passed, suite->positionCount - passed, totalNodes, microseconds, (microseconds) ? totalNodes * 1000000 / microseconds : 0);
+}
+
+// Runs every position up to maxDepth on threadCount threads and prints the JSON report. Returns the number of
+// positions that failed, -1 if the file couldn't be read.
+int runPerftSuite(const char *path, int maxDepth, int threadCount) {
+    PerftSuite suite;
+    if (!readPerftSuite(path, &suite)) {
+        free(suite.positions);
+        return -1;
+    }
+    suite.nextPosition = 0;
+    suite.maxDepth = maxDepth;
+    initMutex(&suite.lock);
+    if (threadCount > MAX_THREADS) threadCount = MAX_THREADS;
+    if (threadCount > suite.positionCount) threadCount = (suite.positionCount) ? suite.positionCount : 1;
+
+    unsigned long long int start = getTimeMicroseconds();
+    Thread* threads = (Thread*)malloc(threadCount * sizeof(Thread));
+    int started = 0;
+    while (threads != NULL && started < threadCount && startThread(&threads[started], perftSuiteWorker, &suite)) started++;
+    // With no threads at all the positions are run here
+    if (!started) perftSuiteWorker(&suite);
+    for (int i = 0; i < started; i++) joinThread(threads[i]);
+    unsigned long long int elapsed = getTimeMicroseconds() - start;
+
+    printPerftSuiteJson(stdout, path, &suite, (started) ? started : 1, elapsed);
+    fflush(stdout);
+    int failed = 0;
+    for (int i = 0; i < suite.positionCount; i++) failed += !suite.positions[i].passed;
+    free(threads);
+    free(suite.positions);
+    destroyMutex(&suite.lock);
+    return failed;
+}
+
+// Search. Negamax alpha-beta with principal variation search, run one depth at a time by iterative deepening.
+// Scores are in centipawns from the side to move's point of view. Mate scores count down from MATE_SCORE by the
+// number of plies to the mate, so shorter mates score higher.
+#define INFINITE_SCORE 32000
+#define MATE_SCORE 31000
+#define MATE_BOUND (MATE_SCORE - MAX_PLY)
+
+// Set through the UCI Threads option
+int searchThreadCount = 1;
+
+// Lazy SMP: every thread searches the whole tree from the root on its own copy of the board. They only share
+// the hash table, so what one thread finds cuts the others' searches short, and the stop flag.
+typedef struct SearchWorker SearchWorker;
+
+typedef struct {
+    int depthLimit;
+    // Microseconds, 0 for no limit. The soft limit is checked between iterations, the hard one inside the search.
+    unsigned long long int softTime;
+    unsigned long long int hardTime;
+    unsigned long long int nodeLimit; // 0 for no limit
+    // Set before the search starts, then changed while it runs by the input thread or the main search thread, so
+    // read and written through loadCounter and loadFlag and their stores from then on
+    unsigned long long int startTime;
+    bool stop;
+    bool ponder; // searching on the opponent's time, the clock only starts at ponderhit
+    bool infinite; // the best move waits for stop even if the search ends sooner
+    bool isQuiet; // prints nothing, for bench
+    Move bestMove;
+    // One per thread, kept between searches so the pawn tables stay warm
+    SearchWorker* workers;
+    int workerCount;
+} SearchInfo;
+
+struct SearchWorker {
+    Board board;
+    SearchInfo* info;
+    int id; // 0 is the main thread, which keeps time and prints
+    unsigned long long int nodes;
+    // Triangular PV table, pv[ply] holds the best line found from ply on
+    Move pv[MAX_PLY][MAX_PLY];
+    int pvLength[MAX_PLY];
+    // The line from the last finished iteration, its moves are searched first
+    Move previousPv[MAX_PLY];
+    int previousPvLength;
+    int completedDepth;
+    int score;
+    // Quiet moves that caused cutoffs: the last two at each ply, the last reply to each move by its from and to
+    // squares, and depth squared totals by side, from and to
+    Move killers[MAX_PLY][2];
+    Move counterMoves[64][64];
+    int history[2][64][64];
+    PawnTable pawnTable;
+    Thread thread;
+    bool isRunning;
+};
+
+TranspositionTable tt;
+
+bool initTranspositionTable(TranspositionTable *table, unsigned long long int megabytes) {
+    unsigned long long int bucketCount = 1;
+    while (bucketCount * 2 * sizeof(TTBucket) <= megabytes * 1024 * 1024) bucketCount *= 2;
+    TTBucket* buckets = (TTBucket*)alignedAlloc(bucketCount * sizeof(TTBucket), 64);
+    if (buckets == NULL) return false;
+    if (table->buckets != NULL) alignedFree(table->buckets);
+    table->buckets = buckets;
+    table->bucketMask = bucketCount - 1;
+    memset(table->buckets, 0, bucketCount * sizeof(TTBucket));
+    table->age = 0;
+    return true;
+}
+
+void clearTranspositionTable(TranspositionTable *table) {
+    memset(table->buckets, 0, (table->bucketMask + 1) * sizeof(TTBucket));
+    table->age = 0;
+}
+
+// Mate scores are stored relative to the node rather than the root, so they stay right wherever the position turns up
+int scoreToTT(int score, int ply) {
+    return (score > MATE_BOUND) ? score + ply : (score < -MATE_BOUND) ? score - ply : score;
+}
+
+int scoreFromTT(int score, int ply) {
+    return (score > MATE_BOUND) ? score - ply : (score < -MATE_BOUND) ? score + ply : score;
+}
+
+// Returns true and fills in the entry's fields if the position is in the table
+bool probeTT(TranspositionTable *table, unsigned long long int key, Move *move, int *score, int *depth, int *bound) {
+    TTBucket* bucket = &table->buckets[key & table->bucketMask];
+    for (int i = 0; i < 4; i++) {
+        unsigned long long int data = bucket->entries[i].data;
+        if ((bucket->entries[i].key ^ data) == key) {
+            *move = (Move)(data & 0xFFFF);
+            *score = (short)((data >> 16) & 0xFFFF);
+            *depth = (int)((data >> 32) & 0xFF);
+            *bound = (int)((data >> 40) & 3);
+            return true;
+        }
+    }
+    return false;
+}
+
+void storeTT(TranspositionTable *table, unsigned long long int key, Move move, int score, int depth, int bound) {
+    TTBucket* bucket = &table->buckets[key & table->bucketMask];
+    TTEntry* replace = &bucket->entries[0];
+    int replaceValue = INFINITE_SCORE;
+    for (int i = 0; i < 4; i++) {
+        TTEntry* entry = &bucket->entries[i];
+        unsigned long long int data = entry->data;
+        if ((entry->key ^ data) == key) {
+            // Same position, keep the old move if the new search didn't find one
+            if (!move) move = (Move)(data & 0xFFFF);
+            replace = entry;
+            break;
+        }
+        // Otherwise the entry that is shallowest, counting entries from older searches as shallower still
+        int entryAge = (int)((data >> 42) & 0x3F);
+        int value = (int)((data >> 32) & 0xFF) - 8 * ((table->age - entryAge) & 0x3F);
+        if (value < replaceValue) {
+            replaceValue = value;
+            replace = entry;
+        }
+    }
+    unsigned long long int data = move | ((unsigned long long int)(unsigned short)score << 16)
+        | ((unsigned long long int)(depth & 0xFF) << 32) | ((unsigned long long int)bound << 40)
+        | ((unsigned long long int)(table->age & 0x3F) << 42);
+    replace->key = key ^ data;
+    replace->data = data;
+}
+
+int pieceValues[7] = { 0, 100, 320, 330, 500, 900, 0 };
+
+// Positional terms, from white's side like the piece scores
+int passedPawnMg[8] = { 0, 5, 10, 20, 35, 60, 100, 0 };
+int passedPawnEg[8] = { 0, 10, 20, 40, 70, 120, 200, 0 };
+int mobilityMg[7] = { 0, 0, 4, 5, 2, 1, 0 };
+int mobilityEg[7] = { 0, 0, 4, 5, 4, 2, 0 };
+int mobilityBase[7] = { 0, 0, 4, 6, 7, 13, 0 }; // about what a piece reaches on an average square
+int kingAttackWeights[7] = { 0, 0, 2, 2, 3, 5, 0 };
+
+// Every square each side's pawns could attack as they advance
+void computeAttackSpans(Board *board, unsigned long long int attackSpans[2]) {
+    unsigned long long int front = board->pieceBB[1];
+    front |= front << 8;
+    front |= front << 16;
+    front |= front << 32;
+    attackSpans[0] = squaresSeen(board->emptyBB, front, 1, 0);
+    front = board->pieceBB[8];
+    front |= front >> 8;
+    front |= front >> 16;
+    front |= front >> 32;
+    attackSpans[1] = squaresSeen(board->emptyBB, front, 1, 1);
+}
+
+// Doubled, isolated, backward and passed pawns. A backward pawn can't be defended by its neighbours as they advance
+// and can't step forward without being taken by an enemy pawn.
+void computePawnScores(Board *board, unsigned long long int attackSpans[2], int *scoreMg, int *scoreEg) {
+    for (int color = 0; color < 2; color++) {
+        int sign = (color) ? -1 : 1;
+        unsigned long long int ownPawns = board->pieceBB[color * 7 + 1], enemyPawns = board->pieceBB[(1 - color) * 7 + 1];
+        unsigned long long int enemyPawnAttacks = squaresSeen(board->emptyBB, enemyPawns, 1, !color);
+        unsigned long long int pawns = ownPawns;
+        if (pawns) do {
+            int squareIndex = bitScanForward(pawns);
+            int file = squareIndex & 7;
+            int rank = (color) ? 7 - squareIndex / 8 : squareIndex / 8;
+            if (!(ownPawns & adjacentFilesMasks[file])) {
+                *scoreMg -= sign * 10;
+                *scoreEg -= sign * 15;
+            }
+            if (ownPawns & fileMasks[file] & ~(1ULL << squareIndex)) {
+                *scoreMg -= sign * 5;
+                *scoreEg -= sign * 10;
+            }
+            unsigned long long int stopSquare = (color) ? (1ULL << squareIndex) >> 8 : (1ULL << squareIndex) << 8;
+            if ((stopSquare & enemyPawnAttacks) && !(stopSquare & attackSpans[color])) {
+                *scoreMg -= sign * 8;
+                *scoreEg -= sign * 10;
+            }
+            if (!(enemyPawns & passedPawnMasks[color][squareIndex])) {
+                *scoreMg += sign * passedPawnMg[rank];
+                *scoreEg += sign * passedPawnEg[rank];
+            }
+        } while (pawns &= pawns - 1);
+    }
+}
+
+void clearPawnTable(PawnTable *table) {
+    memset(table, 0, sizeof(PawnTable));
+}
+
+// Pawn structure scores out of the pawn table, computed and stored on a miss
+void evaluatePawns(Board *board, PawnTable *table, int *scoreMg, int *scoreEg) {
+    PawnEntry* entry = &table->entries[board->pawnKey & (PAWN_TABLE_SIZE - 1)];
+    table->probes++;
+    if (entry->key == board->pawnKey) {
+        table->hits++;
+    }
+    else {
+        unsigned long long int attackSpans[2];
+        int pawnMg = 0, pawnEg = 0;
+        computeAttackSpans(board, attackSpans);
+        computePawnScores(board, attackSpans, &pawnMg, &pawnEg);
+        entry->key = board->pawnKey;
+        entry->scoreMg = (short)pawnMg;
+        entry->scoreEg = (short)pawnEg;
+    }
+    *scoreMg += entry->scoreMg;
+    *scoreEg += entry->scoreEg;
+}
+
+// Mobility of knights, bishops, rooks and queens over squares not held by own pieces or enemy pawns, pressure
+// on the enemy king's surroundings from those same moves, and the pawn shield in front of each king.
+void evaluatePieces(Board *board, int *scoreMg, int *scoreEg) {
+    for (int color = 0; color < 2; color++) {
+        int sign = (color) ? -1 : 1, self = color * 7, opp = (1 - color) * 7;
+        unsigned long long int enemyPawnAttacks = squaresSeen(board->emptyBB, board->pieceBB[opp + 1], 1, !color);
+        unsigned long long int safe = ~board->pieceBB[self] & ~enemyPawnAttacks;
+        unsigned long long int kingZone = kingAttacks(board->pieceBB[opp + 6]) | board->pieceBB[opp + 6];
+        int attackers = 0, attackUnits = 0;
+        for (int piece = 2; piece <= 5; piece++) {
+            unsigned long long int pieces = board->pieceBB[self + piece];
+            if (pieces) do {
+                int squareIndex = bitScanForward(pieces);
+                unsigned long long int attacks =
+                    (piece == 2) ? squaresSeen(board->emptyBB, 1ULL << squareIndex, 2, color)
+                    : (piece == 3) ? bishopAttacks(squareIndex, board->occupiedBB)
+                    : (piece == 4) ? rookAttacks(squareIndex, board->occupiedBB)
+                    : bishopAttacks(squareIndex, board->occupiedBB) | rookAttacks(squareIndex, board->occupiedBB);
+                int mobility = popCount(attacks & safe) - mobilityBase[piece];
+                *scoreMg += sign * mobilityMg[piece] * mobility;
+                *scoreEg += sign * mobilityEg[piece] * mobility;
+                if (attacks & kingZone) {
+                    attackers++;
+                    attackUnits += kingAttackWeights[piece] * popCount(attacks & kingZone);
+                }
+            } while (pieces &= pieces - 1);
+        }
+        // One piece near the king is rarely a threat, several together grow quickly
+        if (attackers >= 2) {
+            int danger = attackUnits * attackUnits / 4;
+            *scoreMg += sign * ((danger < 500) ? danger : 500);
+        }
+        int kingSquareIndex = bitScanForward(board->pieceBB[self + 6]);
+        *scoreMg += sign * 10 * popCount(board->pieceBB[self + 1] & pawnShieldMasks[color][kingSquareIndex]);
+    }
+}
+
+// The network's score for the side to move, kept well clear of mate scores whatever the network says
+int evaluateNnue(Board *board) {
+    int output = nnueOutput(board->accumulator[board->playerToMove], board->accumulator[!board->playerToMove], network.outputWeights);
+    long long int score = (long long int)(output + network.outputBias) * NNUE_SCALE / (NNUE_QA * NNUE_QB);
+    return (score > 20000) ? 20000 : (score < -20000) ? -20000 : (int)score;
+}
+
+// Tapered evaluation: middlegame and endgame scores blended by how much material is left. Material and
+// piece-square scores come ready made from the board, pawn structure from the pawn table.
+// Returned from the side to move's view. A loaded network replaces all of it.
+int evaluate(Board *board, PawnTable *pawnTable) {
+    if (network.isLoaded) return evaluateNnue(board);
+    int scoreMg = board->scoreMg, scoreEg = board->scoreEg;
+    evaluatePawns(board, pawnTable, &scoreMg, &scoreEg);
+    evaluatePieces(board, &scoreMg, &scoreEg);
+    int phase = (board->phase < MAX_PHASE) ? board->phase : MAX_PHASE;
+    int score = (scoreMg * phase + scoreEg * (MAX_PHASE - phase)) / MAX_PHASE;
+    return (board->playerToMove) ? -score : score;
+}
+
+// A position that already came up since the last irreversible move, in the game or on the current line, is scored
+// as a draw. The undo stack holds the key from before each move, so entry i is the position with i moves played.
+bool isRepetition(Board *board) {
+    UndoStack* history = &(board->history);
+    for (int i = history->length - 2; i >= 0 && i >= history->length - board->halfMoveClock; i -= 2) {
+        if (history->entries[i].zobristKey == board->zobristKey) return true;
+    }
+    return false;
+}
+
+void initSearchInfo(SearchInfo *info) {
+    info->isQuiet = false;
+    info->workers = NULL;
+    info->workerCount = 0;
+}
+
+void destroySearchInfo(SearchInfo *info) {
+    free(info->workers);
+    info->workers = NULL;
+    info->workerCount = 0;
+}
+
+// Makes room for count threads, with empty pawn tables. Keeps the current ones if there isn't the memory.
+bool setSearchThreads(SearchInfo *info, int count) {
+    SearchWorker* workers = (SearchWorker*)malloc(count * sizeof(SearchWorker));
+    if (workers == NULL) return false;
+    free(info->workers);
+    info->workers = workers;
+    info->workerCount = count;
+    for (int i = 0; i < count; i++) {
+        workers[i].info = info;
+        workers[i].id = i;
+        clearPawnTable(&workers[i].pawnTable);
+    }
+    return true;
+}
+
+unsigned long long int searchNodes(SearchInfo *info) {
+    unsigned long long int nodes = 0;
+    for (int i = 0; i < info->workerCount; i++) nodes += loadCounter(&info->workers[i].nodes);
+    return nodes;
+}
+
+// How many nodes the main thread searches between looks at the clock, about a third of a millisecond
+#define TIME_CHECK_INTERVAL 1024
+
+// Only the main thread checks, the helpers just watch the stop flag
+void checkTime(SearchInfo *info) {
+    if (info->nodeLimit && searchNodes(info) >= info->nodeLimit) storeFlag(&info->stop, true);
+    if (loadFlag(&info->ponder)) return;
+    if (info->hardTime && getTimeMicroseconds() - loadCounter(&info->startTime) >= info->hardTime) storeFlag(&info->stop, true);
+}
+
+// Pieces of both sides that attack the square with the given occupancy. Pawns are found from the square itself,
+// a white pawn attacks it from where a black pawn on it would attack and the other way around.
+unsigned long long int attackersTo(Board *board, int squareIndex, unsigned long long int occupied) {
+    unsigned long long int square = 1ULL << squareIndex;
+    return (squaresSeen(0, square, 1, 1) & board->pieceBB[1])
+        | (squaresSeen(0, square, 1, 0) & board->pieceBB[8])
+        | (squaresSeen(0, square, 2, 0) & (board->pieceBB[2] | board->pieceBB[9]))
+        | (bishopAttacks(squareIndex, occupied) & (board->pieceBB[3] | board->pieceBB[5] | board->pieceBB[10] | board->pieceBB[12]))
+        | (rookAttacks(squareIndex, occupied) & (board->pieceBB[4] | board->pieceBB[5] | board->pieceBB[11] | board->pieceBB[12]))
+        | (kingAttacks(square) & (board->pieceBB[6] | board->pieceBB[13]));
+}
+
+// Static exchange evaluation: what the move wins or loses in material if both sides keep recapturing on its target
+// square with their least valuable piece, either side free to stop when going on would lose more. Sliders behind
+// the pieces that have taken join in as the square opens up to them. Pins are ignored and only the move itself
+// promotes. Works on bitboards alone, no move is made on the board.
+int see(Board *board, Move move) {
+    int from = getFrom(move), to = getTo(move);
+    int gain[32], depth = 0;
+    unsigned long long int occupied = board->occupiedBB;
+    unsigned long long int diagonal = board->pieceBB[3] | board->pieceBB[5] | board->pieceBB[10] | board->pieceBB[12];
+    unsigned long long int straight = board->pieceBB[4] | board->pieceBB[5] | board->pieceBB[11] | board->pieceBB[12];
+
+    // The value of the piece standing on the square, about to be taken
+    int onSquare = pieceValues[board->boardBySquare[from]];
+    gain[0] = (getIsCapture(move)) ? pieceValues[board->boardBySquare[to]] : 0;
+    if (getIsCapture(move) && !getIsPromotion(move) && getF1(move)) {
+        // En passant, the pawn taken isn't on the target square
+        gain[0] = pieceValues[1];
+        occupied ^= (board->playerToMove) ? (1ULL << to) << 8 : (1ULL << to) >> 8;
+    }
+    if (getIsPromotion(move)) {
+        onSquare = pieceValues[2 + (getF1(move) << 1) + getF2(move)];
+        gain[0] += onSquare - pieceValues[1];
+    }
+    occupied ^= 1ULL << from;
+    unsigned long long int attackers = attackersTo(board, to, occupied) & occupied;
+    int side = !board->playerToMove;
+
+    while (depth < 31) {
+        unsigned long long int own = attackers & board->pieceBB[side * 7];
+        if (!own) break;
+        int piece = 1;
+        while (!(own & board->pieceBB[side * 7 + piece])) piece++;
+        unsigned long long int attacker = own & board->pieceBB[side * 7 + piece];
+        attacker &= -attacker;
+        unsigned long long int occupiedAfter = occupied ^ attacker;
+        unsigned long long int attackersAfter = (attackers | (bishopAttacks(to, occupiedAfter) & diagonal)
+            | (rookAttacks(to, occupiedAfter) & straight)) & occupiedAfter;
+        // The king can't take into an attack, not even one it uncovers by taking
+        if (piece == 6 && (attackersAfter & board->pieceBB[!side * 7])) break;
+
+        depth++;
+        gain[depth] = onSquare - gain[depth - 1];
+        onSquare = pieceValues[piece];
+        occupied = occupiedAfter;
+        attackers = attackersAfter;
+        side = !side;
+    }
+    // Each side only takes if it comes out better than not taking
+    for (; depth > 0; depth--) {
+        if (gain[depth] > -gain[depth - 1]) gain[depth - 1] = -gain[depth];
+    }
+    return gain[0];
+}
+
+// Staged move picker. Moves come out a stage at a time: the hash move, captures and promotions best first by
+// most valuable victim and least valuable attacker, the killers and the counter move, the captures that static
+// exchange says lose material, then the other quiet moves by history. Losing captures often still refute a move,
+// so they come before the quiet moves. Put after them instead they measured about the same, so they stayed here.
+// Each stage is only generated once the ones before it run out, so a node that cuts off early never generates its
+// quiet moves at all. Moves from outside this position, hash, killer and counter moves, are checked
+// for legality before they are handed out and skipped when they turn up again in the generated stages. For the
+// quiescence search it hands out just the captures and promotions that don't lose material.
+#define STAGE_HASH 0
+#define STAGE_GENERATE_CAPTURES 1
+#define STAGE_CAPTURES 2
+#define STAGE_SPECIALS 3
+#define STAGE_BAD_CAPTURES 4
+#define STAGE_GENERATE_QUIETS 5
+#define STAGE_QUIETS 6
+#define STAGE_DONE 7
+
+typedef struct {
+    int stage;
+    Move hashMove;
+    Move specials[3]; // killers then the counter move
+    int specialIndex;
+    MoveBuffer moves;
+    int scores[MAX_MOVES];
+    int index;
+    Move badCaptures[MAX_MOVES];
+    int badCaptureCount;
+    bool capturesOnly;
+} MovePicker;
+
+void initMovePicker(MovePicker *picker, SearchWorker *worker, Move hashMove, int ply) {
+    Board* board = &worker->board;
+    picker->stage = STAGE_HASH;
+    picker->hashMove = hashMove;
+    picker->specials[0] = worker->killers[ply][0];
+    picker->specials[1] = worker->killers[ply][1];
+    picker->specials[2] = 0;
+    if (board->history.length) {
+        Move previous = board->history.entries[board->history.length - 1].move;
+        if (previous) picker->specials[2] = worker->counterMoves[getFrom(previous)][getTo(previous)];
+    }
+    picker->specialIndex = 0;
+    picker->badCaptureCount = 0;
+    picker->capturesOnly = false;
+}
+
+void initQuiescencePicker(MovePicker *picker) {
+    picker->stage = STAGE_GENERATE_CAPTURES;
+    picker->hashMove = 0;
+    picker->badCaptureCount = 0;
+    picker->capturesOnly = true;
+}
+
+// Hands out the highest scored move left in the current stage, by selection since most nodes only look at a few
+static inline Move pickBest(MovePicker *picker) {
+    int best = picker->index;
+    for (int i = picker->index + 1; i < picker->moves.length; i++) {
+        if (picker->scores[i] > picker->scores[best]) best = i;
+    }
+    Move move = picker->moves.moves[best];
+    picker->moves.moves[best] = picker->moves.moves[picker->index];
+    picker->scores[best] = picker->scores[picker->index];
+    picker->index++;
+    return move;
+}
+
+static inline bool isSpecial(MovePicker *picker, Move move) {
+    return move == picker->specials[0] || move == picker->specials[1] || move == picker->specials[2];
+}
+
+// The next move to search, 0 once there are none left
+Move nextMove(MovePicker *picker, SearchWorker *worker) {
+    Board* board = &worker->board;
+    Move move;
+    switch (picker->stage) {
+    case STAGE_HASH:
+        picker->stage = STAGE_GENERATE_CAPTURES;
+        if (picker->hashMove && isLegalMove(board, picker->hashMove)) return picker->hashMove;
+        picker->hashMove = 0;
+        // fall through
+    case STAGE_GENERATE_CAPTURES:
+        picker->moves.length = 0;
+        picker->index = 0;
+        generateMovesOfType(&picker->moves, board, GEN_CAPTURES, ~0ULL);
+        for (int i = 0; i < picker->moves.length; i++) {
+            move = picker->moves.moves[i];
+            // An empty target square on a capture is en passant
+            int victim = (getIsCapture(move)) ? pieceValues[board->boardBySquare[getTo(move)]] + pieceValues[1] * !board->boardBySquare[getTo(move)] : 0;
+            if (getIsPromotion(move)) victim += pieceValues[2 + (getF1(move) << 1) + getF2(move)] - pieceValues[1];
+            picker->scores[i] = 10 * victim - pieceValues[board->boardBySquare[getFrom(move)]];
+        }
+        picker->stage = STAGE_CAPTURES;
+        // fall through
+    case STAGE_CAPTURES:
+        while (picker->index < picker->moves.length) {
+            move = pickBest(picker);
+            if (move == picker->hashMove) continue;
+            // Taking something worth at least the piece that takes can't lose, only the rest need the exchange
+            if (pieceValues[board->boardBySquare[getTo(move)]] < pieceValues[board->boardBySquare[getFrom(move)]] && see(board, move) < 0) {
+                if (!picker->capturesOnly) picker->badCaptures[picker->badCaptureCount++] = move;
+                continue;
+            }
+            return move;
+        }
+        if (picker->capturesOnly) {
+            picker->stage = STAGE_DONE;
+            return 0;
+        }
+        picker->stage = STAGE_SPECIALS;
+        // fall through
+    case STAGE_SPECIALS:
+        while (picker->specialIndex < 3) {
+            move = picker->specials[picker->specialIndex++];
+            if (!move || move == picker->hashMove || getIsCapture(move) || getIsPromotion(move)) continue;
+            // The counter move can be one of the killers too
+            bool isRepeat = false;
+            for (int i = 0; i < picker->specialIndex - 1; i++) isRepeat |= picker->specials[i] == move;
+            if (isRepeat) continue;
+            if (isLegalMove(board, move)) return move;
+            // Not playable here, so it can't turn up among the quiet moves either
+            picker->specials[picker->specialIndex - 1] = 0;
+        }
+        picker->index = 0;
+        picker->stage = STAGE_BAD_CAPTURES;
+        // fall through
+    case STAGE_BAD_CAPTURES:
+        if (picker->index < picker->badCaptureCount) return picker->badCaptures[picker->index++];
+        picker->stage = STAGE_GENERATE_QUIETS;
+        // fall through
+    case STAGE_GENERATE_QUIETS:
+        picker->moves.length = 0;
+        picker->index = 0;
+        generateMovesOfType(&picker->moves, board, GEN_QUIETS, ~0ULL);
+        for (int i = 0; i < picker->moves.length; i++) {
+            move = picker->moves.moves[i];
+            picker->scores[i] = worker->history[board->playerToMove][getFrom(move)][getTo(move)];
+        }
+        picker->stage = STAGE_QUIETS;
+        // fall through
+    case STAGE_QUIETS:
+        while (picker->index < picker->moves.length) {
+            move = pickBest(picker);
+            if (move != picker->hashMove && !isSpecial(picker, move)) return move;
+        }
+        picker->stage = STAGE_DONE;
+        // fall through
+    default:
+        return 0;
+    }
+}
+
+// A quiet move that caused a cutoff becomes a killer at this ply and the counter to the move before it, and gains
+// history. Totals are halved now and then to stay well inside an int.
+void updateQuietStats(SearchWorker *worker, Move move, int depth, int ply) {
+    Board* board = &worker->board;
+    if (worker->killers[ply][0] != move) {
+        worker->killers[ply][1] = worker->killers[ply][0];
+        worker->killers[ply][0] = move;
+    }
+    if (board->history.length) {
+        Move previous = board->history.entries[board->history.length - 1].move;
+        if (previous) worker->counterMoves[getFrom(previous)][getTo(previous)] = move;
+    }
+    int* history = &worker->history[worker->board.playerToMove][0][0];
+    history[getFrom(move) * 64 + getTo(move)] += depth * depth;
+    if (history[getFrom(move) * 64 + getTo(move)] > 1000000) {
+        for (int i = 0; i < 64 * 64; i++) history[i] /= 2;
+    }
+}
+
+// Quiescence search, run at the leaves so they aren't scored in the middle of an exchange. The side to move can
+// stand pat on the static evaluation or try captures and promotions, except in check where every evasion is
+// searched. Captures that lose material by static exchange are left out, and so are those that couldn't lift the
+// score to alpha even if the piece were taken for free (delta pruning).
+#define DELTA_MARGIN 200
+
+int quiescence(SearchWorker *worker, int ply, int alpha, int beta) {
+    Board* board = &worker->board;
+    SearchInfo* info = worker->info;
+    worker->pvLength[ply] = 0;
+    if (worker->id == 0 && (worker->nodes & (TIME_CHECK_INTERVAL - 1)) == 0) checkTime(info);
+    if (loadFlag(&info->stop)) return 0;
+    storeCounter(&worker->nodes, worker->nodes + 1);
+
+    if (ply > 0 && (board->halfMoveClock >= 100 || isRepetition(board))) return 0;
+    bool isInCheck = checkers(board) != 0;
+    if (ply >= MAX_PLY - 1) return (isInCheck) ? 0 : evaluate(board, &worker->pawnTable);
+    int bestScore = -INFINITE_SCORE, standPat = 0, score;
+    MovePicker picker;
+    if (isInCheck) initMovePicker(&picker, worker, 0, ply);
+    else {
+        standPat = evaluate(board, &worker->pawnTable);
+        if (standPat >= beta) return standPat;
+        if (standPat > alpha) alpha = standPat;
+        bestScore = standPat;
+        initQuiescencePicker(&picker);
+    }
+
+    Move move;
+    int moveCount = 0;
+    while ((move = nextMove(&picker, worker)) != 0) {
+        moveCount++;
+        if (!isInCheck && !getIsPromotion(move)) {
+            // An empty target square on a capture is en passant
+            int victim = (board->boardBySquare[getTo(move)]) ? pieceValues[board->boardBySquare[getTo(move)]] : pieceValues[1];
+            if (standPat + victim + DELTA_MARGIN <= alpha) continue;
+        }
+        makeMove(board, move);
+        score = -quiescence(worker, ply + 1, -beta, -alpha);
+        unmakeMove(board, move);
+        if (loadFlag(&info->stop)) return 0;
+
+        if (score > bestScore) {
+            bestScore = score;
+            if (score > alpha) {
+                alpha = score;
+                worker->pv[ply][0] = move;
+                memcpy(&worker->pv[ply][1], worker->pv[ply + 1], worker->pvLength[ply + 1] * sizeof(Move));
+                worker->pvLength[ply] = worker->pvLength[ply + 1] + 1;
+                if (alpha >= beta) break;
+            }
+        }
+    }
+    if (isInCheck && moveCount == 0) return -MATE_SCORE + ply;
+    return bestScore;
+}
+
+int alphaBeta(SearchWorker *worker, int depth, int ply, int alpha, int beta) {
+    if (depth <= 0) return quiescence(worker, ply, alpha, beta);
+    Board* board = &worker->board;
+    SearchInfo* info = worker->info;
+    worker->pvLength[ply] = 0;
+    if (worker->id == 0 && (worker->nodes & (TIME_CHECK_INTERVAL - 1)) == 0) checkTime(info);
+    if (loadFlag(&info->stop)) return 0;
+    storeCounter(&worker->nodes, worker->nodes + 1);
+
+    if (ply > 0 && (board->halfMoveClock >= 100 || isRepetition(board))) return 0;
+    if (ply >= MAX_PLY - 1) return evaluate(board, &worker->pawnTable);
+
+    // A deep enough entry can end the search here, except on the PV where the line is wanted in full
+    Move hashMove = 0;
+    int ttScore, ttDepth, ttBound;
+    bool isPvNode = beta - alpha > 1;
+    if (probeTT(&tt, board->zobristKey, &hashMove, &ttScore, &ttDepth, &ttBound) && !isPvNode && ttDepth >= depth) {
+        ttScore = scoreFromTT(ttScore, ply);
+        if (ttBound == BOUND_EXACT
+            || (ttBound == BOUND_LOWER && ttScore >= beta)
+            || (ttBound == BOUND_UPPER && ttScore <= alpha)) {
+            return ttScore;
+        }
+    }
+
+    // The previous iteration's PV move stands in for a missing hash move
+    if (!hashMove && worker->previousPvLength > ply) hashMove = worker->previousPv[ply];
+    MovePicker picker;
+    initMovePicker(&picker, worker, hashMove, ply);
+
+    int bestScore = -INFINITE_SCORE, score, originalAlpha = alpha, moveCount = 0;
+    Move bestMove = 0, move;
+    while ((move = nextMove(&picker, worker)) != 0) {
+        makeMove(board, move);
+        if (moveCount++ == 0) {
+            score = -alphaBeta(worker, depth - 1, ply + 1, -beta, -alpha);
+        }
+        else {
+            // Prove the move is no better than the first with a null window, search it fully only if it is
+            score = -alphaBeta(worker, depth - 1, ply + 1, -alpha - 1, -alpha);
+            if (score > alpha && score < beta) score = -alphaBeta(worker, depth - 1, ply + 1, -beta, -alpha);
+        }
+        unmakeMove(board, move);
+        if (loadFlag(&info->stop)) return 0;
+
+        if (score > bestScore) {
+            bestScore = score;
+            if (score > alpha) {
+                alpha = score;
+                bestMove = move;
+                worker->pv[ply][0] = move;
+                memcpy(&worker->pv[ply][1], worker->pv[ply + 1], worker->pvLength[ply + 1] * sizeof(Move));
+                worker->pvLength[ply] = worker->pvLength[ply + 1] + 1;
+                if (alpha >= beta) {
+                    if (!getIsCapture(move) && !getIsPromotion(move)) updateQuietStats(worker, move, depth, ply);
+                    break;
+                }
+            }
+        }
+    }
+    if (moveCount == 0) return (checkers(board)) ? -MATE_SCORE + ply : 0;
+    storeTT(&tt, board->zobristKey, bestMove, scoreToTT(bestScore, ply), depth,
+        (bestScore >= beta) ? BOUND_LOWER : (bestScore > originalAlpha) ? BOUND_EXACT : BOUND_UPPER);
+    return bestScore;
+}
+
+void printScore(int score) {
+    if (score > MATE_BOUND) printf("score mate %d", (MATE_SCORE - score + 1) / 2);
+    else if (score < -MATE_BOUND) printf("score mate -%d", (MATE_SCORE + score) / 2);
+    else printf("score cp %d", score);
+}
+
+// Iterative deepening on one thread. Odd numbered helpers search every iteration a ply deeper than the rest,
+// so the threads spread out over different depths rather than all racing through the same nodes. The main
+// thread prints a line per finished depth, with the node counts of all the threads, and decides whether there's
+// time for another. The soft limit is stretched while the best move keeps changing or the score is falling.
+void iterativeDeepening(SearchWorker *worker) {
+    char moveText[6];
+    SearchInfo* info = worker->info;
+    int bestMoveChanges = 0, lastScore = 0;
+    for (int iteration = 1; iteration <= info->depthLimit && iteration < MAX_PLY; iteration++) {
+        int depth = iteration + (worker->id & 1);
+        if (depth > info->depthLimit || depth >= MAX_PLY) depth = iteration;
+        int score = alphaBeta(worker, depth, 0, -INFINITE_SCORE, INFINITE_SCORE);
+        // An unfinished iteration can't be trusted, keep the last full one
+        if (loadFlag(&info->stop) || worker->pvLength[0] == 0) break;
+
+        // Changes count for half as much with each iteration that goes by, in hundredths
+        bestMoveChanges /= 2;
+        if (worker->completedDepth && worker->pv[0][0] != worker->previousPv[0]) bestMoveChanges += 100;
+        worker->previousPvLength = worker->pvLength[0];
+        memcpy(worker->previousPv, worker->pv[0], worker->pvLength[0] * sizeof(Move));
+        worker->completedDepth = depth;
+        worker->score = score;
+
+        if (worker->id == 0 && !info->isQuiet) {
+            unsigned long long int elapsed = getTimeMicroseconds() - loadCounter(&info->startTime);
+            unsigned long long int nodes = searchNodes(info);
+            printf("info depth %d ", depth);
+            printScore(score);
+            printf(" nodes %llu nps %llu time %llu pv", nodes, (elapsed) ? nodes * 1000000 / elapsed : 0, elapsed / 1000);
+            for (int i = 0; i < worker->previousPvLength; i++) {
+                moveToText(moveText, worker->previousPv[i]);
+                printf(" %s", moveText);
+            }
+            printf("\n");
+            fflush(stdout);
+        }
+        // No point looking deeper once a forced mate is found
+        if (score > MATE_BOUND || score < -MATE_BOUND) break;
+
+        if (worker->id == 0 && info->softTime && !loadFlag(&info->ponder)) {
+            int scale = 100 + bestMoveChanges;
+            if (iteration > 1 && score < lastScore - 25) scale += 50;
+            if ((getTimeMicroseconds() - loadCounter(&info->startTime)) * 100 >= info->softTime * scale) break;
+        }
+        lastScore = score;
+    }
+}
+
+THREAD_FUNCTION(searchHelper, lpParameter) {
+    iterativeDeepening((SearchWorker*)lpParameter);
+    flushStats();
+    return THREAD_RETURN;
+}
+
+// Runs the search on searchThreadCount threads, this one being the main thread, and prints the best move at the
+// end. The move comes from whichever thread finished the deepest iteration, the main thread on a tie. The caller
+// clears info->stop and sets info->startTime, before starting the thread it runs on if there is one, so a stop
+// that comes in straight after go isn't lost.
+Move searchPosition(Board *board, SearchInfo *info) {
+    char moveText[6];
+    info->bestMove = 0;
+    tt.age = (tt.age + 1) & 0x3F;
+    if (info->workerCount != searchThreadCount && !setSearchThreads(info, searchThreadCount)) {
+        printf("info string couldn't set up %d search threads, using %d\n", searchThreadCount, info->workerCount);
+    }
+    if (info->workerCount == 0) {
+        printf("bestmove 0000\n");
+        fflush(stdout);
+        return 0;
+    }
+
+    for (int i = 0; i < info->workerCount; i++) {
+        SearchWorker* worker = &info->workers[i];
+        copyBoard(&worker->board, board);
+        worker->nodes = 0;
+        worker->pawnTable.probes = 0;
+        worker->pawnTable.hits = 0;
+        worker->previousPvLength = 0;
+        worker->completedDepth = 0;
+        memset(worker->killers, 0, sizeof(worker->killers));
+        memset(worker->counterMoves, 0, sizeof(worker->counterMoves));
+        memset(worker->history, 0, sizeof(worker->history));
+    }
+    // A helper that can't get a thread is left out, the search goes on without it
+    for (int i = 1; i < info->workerCount; i++) {
+        info->workers[i].isRunning = startThread(&info->workers[i].thread, searchHelper, &info->workers[i]);
+    }
+    iterativeDeepening(&info->workers[0]);
+
+    // UCI doesn't allow the best move before stop or ponderhit when pondering or searching without limits
+    while (!loadFlag(&info->stop) && (loadFlag(&info->ponder) || info->infinite)) sleepMilliseconds(1);
+    storeFlag(&info->stop, true);
+    SearchWorker* best = &info->workers[0];
+    unsigned long long int probes = 0, hits = 0;
+    for (int i = 0; i < info->workerCount; i++) {
+        SearchWorker* worker = &info->workers[i];
+        if (i > 0 && worker->isRunning) joinThread(worker->thread);
+        if (worker->completedDepth > best->completedDepth) best = worker;
+        probes += worker->pawnTable.probes;
+        hits += worker->pawnTable.hits;
+        destroyUndoStack(&(worker->board.history));
+    }
+
+    if (best->previousPvLength) info->bestMove = best->previousPv[0];
+    // Out of time before depth 1 finished, any legal move is better than none
+    else {
+        MoveBuffer moves;
+        moves.length = 0;
+        generateMoves(&moves, board);
+        if (moves.length) info->bestMove = moves.moves[0];
+    }
+    if (info->isQuiet) return info->bestMove;
+    printf("info string pawn table hits %llu of %llu probes (%.1f%%)\n", hits, probes, (probes) ? 100.0 * hits / probes : 0.0);
+    if (info->workerCount > 1) {
+        unsigned long long int elapsed = getTimeMicroseconds() - loadCounter(&info->startTime);
+        unsigned long long int nodes = searchNodes(info);
+        printf("info nodes %llu nps %llu time %llu\n", nodes, (elapsed) ? nodes * 1000000 / elapsed : 0, elapsed / 1000);
+    }
+    if (info->bestMove) {
+        moveToText(moveText, info->bestMove);
+        printf("bestmove %s", moveText);
+        if (best->previousPvLength > 1 && best->previousPv[0] == info->bestMove) {
+            moveToText(moveText, best->previousPv[1]);
+            printf(" ponder %s", moveText);
+        }
+        printf("\n");
+    }
+    else printf("bestmove 0000\n");
+    fflush(stdout);
+    return info->bestMove;
+}
+
+void parseInt(char *string, int *integer) {
+    *integer = 0;
+    while (isdigit(*string)) {
+        *integer *= 10;
+        *integer += (*string) - '0';
+        string++;
+    }
+}
+
+// Finds the legal move written as ffttp (e.g. e7e8q), 0 if there is none
+Move parseMove(Board *board, char *moveText) {
+    MoveBuffer moves;
+    moves.length = 0;
+    char text[6];
+    generateMoves(&moves, board);
+    for (int i = 0; i < moves.length; i++) {
+        moveToText(text, moves.moves[i]);
+        if (!strcmp(text, moveText)) return moves.moves[i];
+    }
+    return 0;
+}
+
+// Switches evaluation to the network in the file, or back to the built in evaluation for <empty>. Falls back to
+// the built in one if the file can't be used.
+void setEvalFile(Board *board, char *path) {
+    if (!strcmp(path, "<empty>") || !*path) unloadNetwork();
+    else if (loadNetwork(path)) printf("info string loaded network %s, %s kernels\n", path, nnueKernelName);
+    else {
+        unloadNetwork();
+        printf("info string couldn't load network %s, using the built in evaluation\n", path);
+    }
+    computePieceScores(board);
+}
+
+// Benchmark: perft and a fixed depth search over a fixed set of positions, single threaded and from empty tables
+// so the node counts come out the same on every run of the same build. The total is printed as a signature,
+// a change in it means the search or move generation behaves differently. With several runs the time is
+// reported as the median and standard deviation. Also a standard workload for PGO training.
+typedef struct {
+    const char* fen;
+    int perftDepth; // 0 to leave the position out of the perft part
+} BenchPosition;
+
+BenchPosition benchPositions[] = {
+    { START_FEN, 5 },
+    { "r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq - 0 1", 5 },
+    { "8/2p5/3p4/KP5r/1R3p1k/8/4P1P1/8 w - - 0 1", 6 },
+    { "r3k2r/Pppp1ppp/1b3nbN/nP6/BBP1P3/q4N2/Pp1P2PP/R2Q1RK1 w kq - 0 1", 5 },
+    { "rnbq1k1r/pp1Pbppp/2p5/8/2B5/8/PPP1NnPP/RNBQK2R w KQ - 1 8", 4 },
+    { "r4rk1/1pp1qppp/p1np1n2/2b1p1B1/2B1P1b1/P1NP1N2/1PP1QPPP/R4RK1 w - - 0 10", 4 },
+    { "r1bq1rk1/pp2bppp/2n1pn2/3p4/2PP4/2N1PN2/PP1BBPPP/R2QK2R w KQ - 2 9", 0 },
+    { "2r3k1/pp3ppp/4p3/3pP3/3P2Q1/P1q5/5PPP/4R1K1 b - - 0 25", 0 },
+    { "8/5pk1/6p1/1p1P4/1P3P2/6P1/5K2/8 w - - 0 45", 0 },
+    { "6k1/5p2/1p4p1/p2r3p/P2R3P/1P3PP1/6K1/8 w - - 0 40", 0 },
+};
+
+#define BENCH_POSITIONS (int)(sizeof(benchPositions) / sizeof(benchPositions[0]))
+
+// Node counts and times of one run
+typedef struct {
+    unsigned long long int perftNodes;
+    unsigned long long int perftMicroseconds;
+    unsigned long long int searchNodes;
+    unsigned long long int searchMicroseconds;
+} BenchResult;
+
+// One run, returns false if the search state couldn't be allocated
+bool benchRun(Board *board, int searchDepth, BenchResult *result) {
+    char fen[128];
+    SearchInfo* info = (SearchInfo*)malloc(sizeof(SearchInfo));
+    if (info == NULL) return false;
+    initSearchInfo(info);
+    info->isQuiet = true;
+    int threadCount = searchThreadCount;
+    searchThreadCount = 1;
+    memset(result, 0, sizeof(BenchResult));
+
+    for (int i = 0; i < BENCH_POSITIONS; i++) {
+        strcpy(fen, benchPositions[i].fen);
+        readFenStringToBoard(fen, board);
+        unsigned long long int start = getTimeMicroseconds();
+        if (benchPositions[i].perftDepth) result->perftNodes += perft(board, benchPositions[i].perftDepth);
+        result->perftMicroseconds += getTimeMicroseconds() - start;
+
+        clearTranspositionTable(&tt);
+        info->depthLimit = searchDepth;
+        info->softTime = 0;
+        info->hardTime = 0;
+        info->nodeLimit = 0;
+        info->ponder = false;
+        info->infinite = false;
+        start = getTimeMicroseconds();
+        info->stop = false;
+        info->startTime = start;
+        searchPosition(board, info);
+        result->searchMicroseconds += getTimeMicroseconds() - start;
+        result->searchNodes += searchNodes(info);
+    }
+
+    searchThreadCount = threadCount;
+    destroySearchInfo(info);
+    free(info);
+    return true;
+}
+
+// Median and standard deviation of the times, which get sorted
+void timeStatistics(unsigned long long int *times, int count, unsigned long long int *median, double *deviation) {
+    double mean = 0, variance = 0;
+    for (int i = 0; i < count; i++) mean += (double)times[i] / count;
+    for (int i = 0; i < count; i++) variance += ((double)times[i] - mean) * ((double)times[i] - mean) / count;
+    *deviation = sqrt(variance);
+    // Insertion sort, the lists are short
+    for (int i = 1; i < count; i++) {
+        unsigned long long int time = times[i];
+        int j = i - 1;
+        while (j >= 0 && times[j] > time) {
+            times[j + 1] = times[j];
+            j--;
+        }
+        times[j + 1] = time;
+    }
+    *median = (count & 1) ? times[count / 2] : (times[count / 2 - 1] + times[count / 2]) / 2;
+}
+
+#define BENCH_DEPTH 7
+
+// bench [runs] [depth=<plies>]. Leaves the board at the last position and the hash table empty.
+void bench(Board *board, int runs, int searchDepth) {
+    if (runs < 1) runs = 1;
+    unsigned long long int* times = (unsigned long long int*)malloc(2 * runs * sizeof(unsigned long long int));
+    if (times == NULL) return;
+    unsigned long long int* perftTimes = times, *searchTimes = times + runs;
+    BenchResult result, first;
+    for (int run = 0; run < runs; run++) {
+        if (!benchRun(board, searchDepth, &result)) {
+            printf("couldn't allocate the search state\n");
+            free(times);
+            return;
+        }
+        perftTimes[run] = result.perftMicroseconds;
+        searchTimes[run] = result.searchMicroseconds;
+        printf("run %d: perft %llu nodes in %llu ms, search %llu nodes in %llu ms\n", run + 1, result.perftNodes,
+            result.perftMicroseconds / 1000, result.searchNodes, result.searchMicroseconds / 1000);
+        if (run == 0) first = result;
+        // Only threads or a bug can make the counts differ between runs
+        else if (result.perftNodes != first.perftNodes || result.searchNodes != first.searchNodes) printf("warning: node counts differ from the first run\n");
+        fflush(stdout);
+    }
+
+    unsigned long long int perftMedian, searchMedian;
+    double perftDeviation, searchDeviation;
+    timeStatistics(perftTimes, runs, &perftMedian, &perftDeviation);
+    timeStatistics(searchTimes, runs, &searchMedian, &searchDeviation);
+    printf("positions: %d, search depth %d, %d run%s, times are medians\n", BENCH_POSITIONS, searchDepth, runs, (runs > 1) ? "s" : "");
+    printf("perft: %llu nodes, %llu ms (deviation %.1f ms), %llu nps\n", first.perftNodes, perftMedian / 1000, perftDeviation / 1000,
+        (perftMedian) ? first.perftNodes * 1000000 / perftMedian : 0);
+    printf("search: %llu nodes, %llu ms (deviation %.1f ms), %llu nps\n", first.searchNodes, searchMedian / 1000, searchDeviation / 1000,
+        (searchMedian) ? first.searchNodes * 1000000 / searchMedian : 0);
+    printf("signature: %llu\n", first.perftNodes + first.searchNodes);
+    fflush(stdout);
+    free(times);
+}
+
+// UCI front-end. Searches run on their own thread so stop and ponderhit can be read while they go on, every other
+// command that touches the board or the hash table waits for the search to finish first.
+
+typedef struct {
+    Board* board;
+    SearchInfo* info;
+} SearchJob;
+
+THREAD_FUNCTION(searchThread, lpParameter) {
+    SearchJob* job = (SearchJob*)lpParameter;
+    searchPosition(job->board, job->info);
+    flushStats();
+    return THREAD_RETURN;
+}
+
+typedef struct {
+    SearchJob job;
+    Thread thread;
+    bool isRunning;
+} UciSearch;
+
+// Stops the search if there is one and waits for it to print its best move
+void finishSearch(UciSearch *search) {
+    if (!search->isRunning) return;
+    storeFlag(&search->job.info->stop, true);
+    joinThread(search->thread);
+    search->isRunning = false;
+}
+
+// Thinking time for one move. The soft limit is an even share of the clock over the moves left plus most of the
+// increment. The hard limit gives an unsettled search up to four times that. Neither goes past three quarters of
+// what's left unless it's the last move before the time control, nor closer than 50 ms to the flag.
+void allocateTime(SearchInfo *info, int time, int increment, int movesToGo) {
+    if (movesToGo <= 0) movesToGo = 30;
+    long long int available = (movesToGo == 1) ? time - 50 : (time - 50) * 3 / 4;
+    if (available < 1) available = 1;
+    long long int soft = time / movesToGo + increment * 3 / 4;
+    if (soft > available) soft = available;
+    if (soft < 1) soft = 1;
+    long long int hard = soft * 4;
+    if (hard > available) hard = available;
+    info->softTime = (unsigned long long int)soft * 1000;
+    info->hardTime = (unsigned long long int)hard * 1000;
+}
+
+// position startpos | fen <FEN>, either followed by moves <move> <move> ...
+void uciPosition(Board *board, char *command) {
+    char* movesText = strstr(command, " moves ");
+    bool isValid = (!memcmp(command, "position fen ", 13)) ? readFenStringToBoard(command + 13, board) : readFenStringToBoard(START_FEN, board);
+    if (!isValid || movesText == NULL) return;
+
+    char* moveText = strtok(movesText + 7, " ");
+    while (moveText != NULL) {
+        Move move = parseMove(board, moveText);
+        if (!move) {
+            printf("info string illegal move %s\n", moveText);
+            break;
+        }
+        if (!reserveUndo(&board->history, MAX_PLY + 1)) break;
+        makeMove(board, move);
+        moveText = strtok(NULL, " ");
+    }
+}
+
+// The number in the next word of a command being split by strtok, 0 if there is none
+int nextCommandNumber(void) {
+    int value = 0;
+    char* word = strtok(NULL, " ");
+    if (word != NULL) parseInt(word, &value);
+    return value;
+}
+
+// go [wtime <ms>] [btime <ms>] [winc <ms>] [binc <ms>] [movestogo <n>] [depth <n>] [nodes <n>] [movetime <ms>]
+// [infinite] [ponder]. The command is read a word at a time, any other word is skipped, so searchmoves and the
+// moves after it are ignored.
+void uciGo(UciSearch *search, Board *board, char *command) {
+    SearchInfo* info = search->job.info;
+    int time = -1, increment = 0, movesToGo = 0, moveTime = -1;
+    info->depthLimit = MAX_PLY;
+    info->softTime = 0;
+    info->hardTime = 0;
+    info->nodeLimit = 0;
+    info->infinite = false;
+    info->ponder = false;
+
+    strtok(command, " ");
+    char* word;
+    while ((word = strtok(NULL, " ")) != NULL) {
+        if (!strcmp(word, "infinite")) info->infinite = true;
+        else if (!strcmp(word, "ponder")) info->ponder = true;
+        else if (!strcmp(word, "wtime") || !strcmp(word, "btime")) {
+            int value = nextCommandNumber();
+            if ((word[0] == 'b') == board->playerToMove) time = value;
+        }
+        else if (!strcmp(word, "winc") || !strcmp(word, "binc")) {
+            int value = nextCommandNumber();
+            if ((word[0] == 'b') == board->playerToMove) increment = value;
+        }
+        else if (!strcmp(word, "movestogo")) movesToGo = nextCommandNumber();
+        else if (!strcmp(word, "movetime")) moveTime = nextCommandNumber();
+        else if (!strcmp(word, "depth")) info->depthLimit = nextCommandNumber();
+        else if (!strcmp(word, "nodes")) info->nodeLimit = nextCommandNumber();
+    }
+    if (time >= 0) allocateTime(info, time, increment, movesToGo);
+    // A fixed time per move is all used, there's nothing to save it for
+    if (moveTime >= 0) {
+        info->softTime = 0;
+        info->hardTime = (unsigned long long int)moveTime * 1000;
+    }
+
+    search->job.board = board;
+    info->stop = false;
+    info->startTime = getTimeMicroseconds();
+    search->isRunning = startThread(&search->thread, searchThread, &search->job);
+    // Couldn't get a thread, search here instead. stop and ponderhit won't be seen until it finishes.
+    if (!search->isRunning) searchPosition(board, info);
+}
+
+void uciLoop(Board *board) {
+    char buffer[8192];
+    UciSearch search;
+    search.isRunning = false;
+    search.job.info = (SearchInfo*)malloc(sizeof(SearchInfo));
+    if (search.job.info == NULL) {
+        printf("couldn't allocate the search state\n");
+        return;
+    }
+    initSearchInfo(search.job.info);
+
+    printf("\nid name MyChessEngine\nid author Andrew Borg\n");
+    printf("option name Hash type spin default 16 min 1 max 65536\n");
+    printf("option name Threads type spin default 1 min 1 max %d\n", MAX_THREADS);
+    printf("option name EvalFile type string default <empty>\n");
+    printf("uciok\n");
+    fflush(stdout);
+
+    while (readLine(buffer, sizeof(buffer))) {
+        if (!strcmp(buffer, "quit")) break;
+        else if (!strcmp(buffer, "isready")) printf("readyok\n");
+        else if (!strcmp(buffer, "stop")) finishSearch(&search);
+        else if (!strcmp(buffer, "ponderhit")) {
+            // The move being pondered was played, the search carries on as a normal one from now
+            storeCounter(&search.job.info->startTime, getTimeMicroseconds());
+            storeFlag(&search.job.info->ponder, false);
+        }
+        else if (!strcmp(buffer, "ucinewgame")) {
+            finishSearch(&search);
+            clearTranspositionTable(&tt);
+        }
+        else if (!memcmp(buffer, "position ", 9)) {
+            finishSearch(&search);
+            uciPosition(board, buffer);
+        }
+        else if (!strcmp(buffer, "go") || !memcmp(buffer, "go ", 3)) {
+            finishSearch(&search);
+            uciGo(&search, board, buffer);
+        }
+        else if (!memcmp(buffer, "setoption name Hash value ", 26)) {
+            int megabytes;
+            finishSearch(&search);
+            parseInt(buffer + 26, &megabytes);
+            if (megabytes < 1 || !initTranspositionTable(&tt, megabytes)) printf("info string couldn't allocate %d MB for the hash table\n", megabytes);
+        }
+        else if (!memcmp(buffer, "setoption name EvalFile value ", 30)) {
+            finishSearch(&search);
+            setEvalFile(board, buffer + 30);
+        }
+        else if (!memcmp(buffer, "setoption name Threads value ", 29)) {
+            finishSearch(&search);
+            parseInt(buffer + 29, &searchThreadCount);
+            if (searchThreadCount < 1) searchThreadCount = 1;
+            if (searchThreadCount > MAX_THREADS) searchThreadCount = MAX_THREADS;
+        }
+        fflush(stdout);
+    }
+    finishSearch(&search);
+    destroySearchInfo(search.job.info);
+    free(search.job.info);
+}
+
+THREAD_FUNCTION(ioThread, lpParameter) {
+    Board *board = ((Parameters*)lpParameter)->board;
+
+    char buffer[100] = {'\0'};
+    printf("Welcome to MyChessEngine\nThe board is currently set up at the starting position\nFor a list of commands type \"help\"\nTo exit type q or quit\n");
+    printf("Please keep in mind that his will break if given bad or incorrect input,\nother than FEN strings there is no verification that user provided information is reasonable,\n");
+    printf("the move generation also assumes all of the board state information is correct,\nif this is not the case then there may be unexpected side effects\n");
+    printf("which made debugging a pain.");
+    while (1) {
+        printf("\n> ");
+        if (!readLine(buffer, sizeof(buffer)) || !strcmp(buffer, "q") || !strcmp(buffer, "quit")) return THREAD_RETURN;
+        else if (!strcmp(buffer, "uci")) {
+            uciLoop(board);
+            return THREAD_RETURN;
+        }
+        else if (!strcmp(buffer, "help")) {
+            printf("q - quits the engine\n");
+            printf("uci - switches to the UCI protocol for use with a GUI\n");
+            printf("show - shows the board and FEN string\n");
+            printf("showboard - shows just the board\n");
+            printf("showfen - shows just the FEN string\n");
+            printf("setfen <FEN> - sets the board tho the FEN string\n");
+            printf("perft <depth> [hash=<size>MB] [threads=<count>] - counts leaf nodes, optionally with a hash table of the given size\n");
+            printf("divide <depth> [hash=<size>MB] [threads=<count>] - perft split by root move\n");
+            printf("bench [runs] [depth=<plies>] - perft and search over a fixed set of positions, for timing builds\n");
+            printf("stats [clear] - move generation and make/unmake counters, in builds with MCE_STATS\n");
+            printf("perftsuite <file> [depth=<max>] [threads=<count>] - checks perft against the counts in an EPD file, reports as JSON\n");
+            printf("fencheck <file> - reads every position in a FEN or EPD file, lists the invalid lines and the speed\n");
+            printf("go [depth <plies>] [movetime <ms>] - searches for the best move\n");
+            printf("hash <size> - resizes the search hash table to size MB\n");
+            printf("threads <count> - sets how many threads go searches with\n");
+            printf("evalfile <path> - evaluates with the network in the file, <empty> goes back to the built in evaluation\n");
+        }
+        else if (!strcmp(buffer, "show")) printBoard(1, 1, board);
+        else if (!strcmp(buffer, "showboard")) printBoard(0, 1, board);
+        else if (!strcmp(buffer, "showfen")) printBoard(1, 0, board);
+        else if (!memcmp(buffer, "setfen", 6)) readFenStringToBoard(buffer + 7, board);
+        else if (!memcmp(buffer, "new", 3)) {
+            readFenStringToBoard(START_FEN, board);
+            clearTranspositionTable(&tt);
+        }
+        else if (!strcmp(buffer, "legalmoves")) showAvailableMoves(board);
+        else if (!memcmp(buffer, "move", 4)) {
+            if (reserveUndo(&board->history, MAX_PLY + 1)) makeMove(board, textToMove(buffer + 5, board));
+        }
+        else if (!memcmp(buffer, "undo", 4)) unmakeLastMove(board);
+        else if (!strcmp(buffer, "stats")) printStats(false);
+        else if (!strcmp(buffer, "stats clear")) printStats(true);
+        else if (!memcmp(buffer, "bench", 5)) {
+            // bench [runs] [depth=<plies>]
+            int runs = 1, depth = BENCH_DEPTH;
+            char* depthOption = strstr(buffer, "depth=");
+            if (buffer[5] == ' ' && isdigit(buffer[6])) parseInt(buffer + 6, &runs);
+            if (depthOption != NULL) parseInt(depthOption + 6, &depth);
+            bench(board, runs, depth);
+        }
+        else if (!memcmp(buffer, "fencheck ", 9)) checkFenFile(board, buffer + 9);
+        else if (!memcmp(buffer, "perftsuite ", 11)) {
+            // perftsuite <file> [depth=<max>] [threads=<count>]
+            int maxDepth = MAX_PLY, threadCount = cpuCount();
+            char* depthOption = strstr(buffer, " depth=");
+            char* threadsOption = strstr(buffer, " threads=");
+            if (depthOption != NULL) parseInt(depthOption + 7, &maxDepth);
+            if (threadsOption != NULL) parseInt(threadsOption + 9, &threadCount);
+            if (threadCount < 1) threadCount = 1;
+            char* path = strtok(buffer + 11, " ");
+            if (path == NULL || runPerftSuite(path, maxDepth, threadCount) < 0) printf("couldn't read %s\n", (path) ? path : "");
+        }
+        else if (!memcmp(buffer, "perft", 5) || !memcmp(buffer, "divide", 6)) {
+            // perft <depth> [hash=<size>MB] [threads=<count>], or the same for divide
+            int depth, hashSize = 0, threadCount = 1;
+            bool isDivide = buffer[0] == 'd';
+            char* hashOption = strstr(buffer, "hash=");
+            char* threadsOption = strstr(buffer, "threads=");
+            parseInt(buffer + ((isDivide) ? 7 : 6), &depth);
+            if (hashOption != NULL) parseInt(hashOption + 5, &hashSize);
+            if (threadsOption != NULL) parseInt(threadsOption + 8, &threadCount);
+            if (threadCount < 1) threadCount = 1;
+            if (threadCount > MAX_THREADS) threadCount = MAX_THREADS;
+            if (depth > MAX_PLY) {
+                printf("perft goes up to depth %d\n", MAX_PLY);
+                continue;
+            }
+
+            PerftTable table;
+            if (hashSize > 0 && !initPerftTable(&table, hashSize)) {
+                printf("couldn't allocate %d MB for the perft hash table\n", hashSize);
+                continue;
+            }
+            unsigned long long int start = getTimeMicroseconds(), nodes = 0;
+            if (isDivide) {
+                nodes = divide(board, depth, (hashSize > 0) ? &table : NULL, threadCount);
+            }
+            else {
+                if (threadCount > 1 && depth > 1) {
+                    nodes = parallelPerft(board, depth, threadCount, (hashSize > 0) ? &table : NULL, NULL);
+                }
+                else {
+                    nodes = (hashSize > 0) ? perftHashed(board, depth, &table) : perft(board, depth);
+                }
+                printf("%llu\n", nodes);
+            }
+            printPerftStats(nodes, getTimeMicroseconds() - start, (hashSize > 0) ? &table : NULL);
+            if (hashSize > 0) destroyPerftTable(&table);
+        }
+        else if (!strcmp(buffer, "showsbb")) printSquareBasedBoard(board);
+        else if (!memcmp(buffer, "evalfile ", 9)) setEvalFile(board, buffer + 9);
+        else if (!memcmp(buffer, "threads ", 8)) {
+            parseInt(buffer + 8, &searchThreadCount);
+            if (searchThreadCount < 1) searchThreadCount = 1;
+        }
+        else if (!memcmp(buffer, "hash", 4)) {
+            int megabytes;
+            parseInt(buffer + 5, &megabytes);
+            if (megabytes < 1 || !initTranspositionTable(&tt, megabytes)) printf("couldn't allocate %d MB for the hash table\n", megabytes);
+        }
+        else if (!strcmp(buffer, "go") || !memcmp(buffer, "go ", 3)) {
+            // go depth <plies> | go movetime <milliseconds>, with no limit given searches to depth 6
+            SearchInfo* info = (SearchInfo*)malloc(sizeof(SearchInfo));
+            if (info == NULL) {
+                printf("couldn't allocate the search state\n");
+                continue;
+            }
+            initSearchInfo(info);
+            char* depthOption = strstr(buffer, "depth ");
+            char* timeOption = strstr(buffer, "movetime ");
+            int value;
+            info->depthLimit = (timeOption != NULL) ? MAX_PLY : 6;
+            info->softTime = 0;
+            info->hardTime = 0;
+            info->nodeLimit = 0;
+            info->ponder = false;
+            info->infinite = false;
+            if (depthOption != NULL) {
+                parseInt(depthOption + 6, &value);
+                info->depthLimit = value;
+            }
+            if (timeOption != NULL) {
+                parseInt(timeOption + 9, &value);
+                info->hardTime = (unsigned long long int)value * 1000;
+            }
+            info->stop = false;
+            info->startTime = getTimeMicroseconds();
+            searchPosition(board, info);
+            destroySearchInfo(info);
+            free(info);
+        }
+    }
+    return 0;
+}
+
+#ifdef MCE_MICROBENCH
+// Microbenchmarks of the move generation primitives, built as the MyChessEngineMicrobench target. Each one calls a
+// primitive over the bench positions, warms up first, then takes several timed samples and reports the median
+// nanoseconds per call. The results can be saved as JSON and a later build compared against them, so a change to one
+// kernel can be judged on its own before perft and bench judge the whole.
+#define MICRO_SAMPLES 7
+#define MICRO_WARMUP_MICROSECONDS 100000
+#define MICRO_SAMPLE_MICROSECONDS 20000 // each sample runs for at least this long
+
+typedef struct {
+    Board boards[BENCH_POSITIONS];
+    MoveBuffer moves[BENCH_POSITIONS]; // legal moves of each board
+    char fens[BENCH_POSITIONS][128];
+    Board scratch; // for readFenStringToBoard
+    char pieceSymbols[15];
+} MicroCorpus;
+
+// Results go here so the compiler can't leave out the work
+volatile unsigned long long int microSink;
+
+// A benchmark makes one pass over the corpus and returns how many calls it made
+typedef struct {
+    const char* name;
+    unsigned long long int (*pass)(MicroCorpus *corpus, int parameter);
+    int parameter;
+} Microbenchmark;
+
+// Every piece of the given type, for both sides
+unsigned long long int microSquaresSeen(MicroCorpus *corpus, int piece) {
+    unsigned long long int calls = 0, sink = 0, pieces;
+    for (int i = 0; i < BENCH_POSITIONS; i++) {
+        Board* board = &corpus->boards[i];
+        for (int color = 0; color < 2; color++) {
+            pieces = board->pieceBB[color * 7 + piece];
+            if (pieces) do {
+                sink ^= squaresSeen(board->emptyBB, 1ULL << bitScanForward(pieces), piece, color);
+                calls++;
+            } while (pieces &= pieces - 1);
+        }
+    }
+    microSink += sink;
+    return calls;
+}
+
+// From every occupied square. Inlined into microRay with the ray as a constant, so it isn't timed as a call
+// through a pointer.
+static inline unsigned long long int microRayPass(MicroCorpus *corpus, unsigned long long int (*ray)(unsigned long long int, unsigned long long int)) {
+    unsigned long long int calls = 0, sink = 0, pieces;
+    for (int i = 0; i < BENCH_POSITIONS; i++) {
+        pieces = corpus->boards[i].occupiedBB;
+        if (pieces) do {
+            sink ^= ray(1ULL << bitScanForward(pieces), corpus->boards[i].emptyBB);
+            calls++;
+        } while (pieces &= pieces - 1);
+    }
+    microSink += sink;
+    return calls;
+}
+
+unsigned long long int microRay(MicroCorpus *corpus, int direction) {
+    switch (direction) {
+    case 0: return microRayPass(corpus, ul);
+    case 1: return microRayPass(corpus, u);
+    case 2: return microRayPass(corpus, ur);
+    case 3: return microRayPass(corpus, l);
+    case 4: return microRayPass(corpus, r);
+    case 5: return microRayPass(corpus, dl);
+    case 6: return microRayPass(corpus, d);
+    default: return microRayPass(corpus, dr);
+    }
+}
+
+unsigned long long int microPushCaptureMask(MicroCorpus *corpus, int parameter) {
+    (void)parameter;
+    unsigned long long int sink = 0, pushCapMask;
+    for (int i = 0; i < BENCH_POSITIONS; i++) {
+        makePushAndCaptureMask(&corpus->boards[i], &pushCapMask);
+        sink ^= pushCapMask;
+    }
+    microSink += sink;
+    return BENCH_POSITIONS;
+}
+
+// Both kings of every position
+unsigned long long int microInCheck(MicroCorpus *corpus, int parameter) {
+    (void)parameter;
+    unsigned long long int sink = 0;
+    for (int i = 0; i < BENCH_POSITIONS; i++) {
+        sink += inCheck(&corpus->boards[i], 0);
+        sink += inCheck(&corpus->boards[i], 1);
+    }
+    microSink += sink;
+    return 2 * BENCH_POSITIONS;
+}
+
+// Every legal move of every position made and taken back, one call is the pair
+unsigned long long int microMakeUnmake(MicroCorpus *corpus, int parameter) {
+    (void)parameter;
+    unsigned long long int calls = 0, sink = 0;
+    for (int i = 0; i < BENCH_POSITIONS; i++) {
+        Board* board = &corpus->boards[i];
+        for (int j = 0; j < corpus->moves[i].length; j++) {
+            makeMove(board, corpus->moves[i].moves[j]);
+            sink ^= board->zobristKey;
+            unmakeMove(board, corpus->moves[i].moves[j]);
+        }
+        calls += corpus->moves[i].length;
+    }
+    microSink += sink;
+    return calls;
+}
+
+unsigned long long int microGenerateMoves(MicroCorpus *corpus, int parameter) {
+    (void)parameter;
+    unsigned long long int sink = 0;
+    MoveBuffer moves;
+    for (int i = 0; i < BENCH_POSITIONS; i++) {
+        moves.length = 0;
+        generateMoves(&moves, &corpus->boards[i]);
+        sink += moves.length;
+    }
+    microSink += sink;
+    return BENCH_POSITIONS;
+}
+
+unsigned long long int microCountLegalMoves(MicroCorpus *corpus, int parameter) {
+    (void)parameter;
+    unsigned long long int sink = 0;
+    for (int i = 0; i < BENCH_POSITIONS; i++) sink += countLegalMoves(&corpus->boards[i]);
+    microSink += sink;
+    return BENCH_POSITIONS;
+}
+
+unsigned long long int microReadFen(MicroCorpus *corpus, int parameter) {
+    (void)parameter;
+    unsigned long long int sink = 0;
+    for (int i = 0; i < BENCH_POSITIONS; i++) {
+        readFenStringToBoard(corpus->fens[i], &corpus->scratch);
+        sink ^= corpus->scratch.zobristKey;
+    }
+    microSink += sink;
+    return BENCH_POSITIONS;
+}
+
+unsigned long long int microWriteFen(MicroCorpus *corpus, int parameter) {
+    (void)parameter;
+    unsigned long long int sink = 0;
+    char fen[FEN_BUFFER_SIZE];
+    for (int i = 0; i < BENCH_POSITIONS; i++) sink += writeFen(&corpus->boards[i], fen, sizeof(fen));
+    microSink += sink;
+    return BENCH_POSITIONS;
+}
+
+Microbenchmark microbenchmarks[] = {
+    { "squaresSeen/pawn", microSquaresSeen, 1 },
+    { "squaresSeen/knight", microSquaresSeen, 2 },
+    { "squaresSeen/bishop", microSquaresSeen, 3 },
+    { "squaresSeen/rook", microSquaresSeen, 4 },
+    { "squaresSeen/queen", microSquaresSeen, 5 },
+    { "ray/ul", microRay, 0 },
+    { "ray/u", microRay, 1 },
+    { "ray/ur", microRay, 2 },
+    { "ray/l", microRay, 3 },
+    { "ray/r", microRay, 4 },
+    { "ray/dl", microRay, 5 },
+    { "ray/d", microRay, 6 },
+    { "ray/dr", microRay, 7 },
+    { "makePushAndCaptureMask", microPushCaptureMask, 0 },
+    { "inCheck", microInCheck, 0 },
+    { "makeMove+unmakeMove", microMakeUnmake, 0 },
+    { "generateMoves", microGenerateMoves, 0 },
+    { "countLegalMoves", microCountLegalMoves, 0 },
+    { "readFenStringToBoard", microReadFen, 0 },
+    { "writeFen", microWriteFen, 0 },
+};
+
+#define MICROBENCHMARKS (int)(sizeof(microbenchmarks) / sizeof(microbenchmarks[0]))
+
+// Median nanoseconds per call, and the deviation in percent of it. A sample is as many passes as took
+// MICRO_SAMPLE_MICROSECONDS during the warm-up, so every sample makes the same calls.
+double runMicrobenchmark(MicroCorpus *corpus, Microbenchmark *benchmark, unsigned long long int *calls, double *deviation) {
+    unsigned long long int passes = 0, elapsed, start = getTimeMicroseconds();
+    do {
+        benchmark->pass(corpus, benchmark->parameter);
+        passes++;
+        elapsed = getTimeMicroseconds() - start;
+    } while (elapsed < MICRO_WARMUP_MICROSECONDS);
+    unsigned long long int samplePasses = passes * MICRO_SAMPLE_MICROSECONDS / elapsed + 1;
+
+    unsigned long long int times[MICRO_SAMPLES], median, sampleCalls = 0;
+    for (int sample = 0; sample < MICRO_SAMPLES; sample++) {
+        sampleCalls = 0;
+        start = getTimeMicroseconds();
+        for (unsigned long long int pass = 0; pass < samplePasses; pass++) sampleCalls += benchmark->pass(corpus, benchmark->parameter);
+        times[sample] = getTimeMicroseconds() - start;
+    }
+    timeStatistics(times, MICRO_SAMPLES, &median, deviation);
+    *calls = sampleCalls * MICRO_SAMPLES;
+    *deviation = (median) ? *deviation * 100 / median : 0;
+    return (sampleCalls) ? median * 1000.0 / sampleCalls : 0;
+}
+
+// The whole file with a terminating zero, or NULL if it can't be read
+char* readTextFile(const char *path) {
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) return NULL;
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    char* text = (size >= 0) ? (char*)malloc(size + 1) : NULL;
+    if (text != NULL) text[fread(text, 1, size, file)] = '\0';
+    fclose(file);
+    return text;
+}
+
+// Time per call of the named benchmark in JSON this program wrote, -1 if it isn't in there
+double baselineTime(const char *json, const char *name) {
+    char key[96];
+    snprintf(key, sizeof(key), "\"name\": \"%s\"", name);
+    const char* found = strstr(json, key);
+    if (found == NULL || (found = strstr(found, "\"real_time\": ")) == NULL) return -1;
+    return atof(found + 13);
+}
+
+// MyChessEngineMicrobench [filter=<text>] [baseline=<file>] [json=<file>]
+// Runs the benchmarks with names containing the filter text, compares them with the baseline and writes them to the
+// JSON file, in the same layout as the baseline is read in.
+int runMicrobenchmarks(int argc, char **argv) {
+    const char* filter = "", *baselinePath = NULL, *jsonPath = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (!memcmp(argv[i], "filter=", 7)) filter = argv[i] + 7;
+        else if (!memcmp(argv[i], "baseline=", 9)) baselinePath = argv[i] + 9;
+        else if (!memcmp(argv[i], "json=", 5)) jsonPath = argv[i] + 5;
+        else {
+            printf("usage: %s [filter=<text>] [baseline=<file>] [json=<file>]\n", argv[0]);
+            return 1;
+        }
+    }
+    char* baseline = NULL;
+    if (baselinePath != NULL && (baseline = readTextFile(baselinePath)) == NULL) {
+        printf("couldn't read %s\n", baselinePath);
+        return 1;
+    }
+    FILE* json = NULL;
+    if (jsonPath != NULL && (json = fopen(jsonPath, "w")) == NULL) {
+        printf("couldn't write %s\n", jsonPath);
+        free(baseline);
+        return 1;
+    }
+    MicroCorpus* corpus = (MicroCorpus*)alignedAlloc(sizeof(MicroCorpus), 64);
+    if (corpus == NULL) {
+        printf("couldn't allocate the positions\n");
+        free(baseline);
+        if (json != NULL) fclose(json);
+        return 1;
+    }
+    initBoardState(&corpus->scratch, corpus->pieceSymbols);
+    for (int i = 0; i < BENCH_POSITIONS; i++) {
+        strcpy(corpus->fens[i], benchPositions[i].fen);
+        initBoardState(&corpus->boards[i], corpus->pieceSymbols);
+        readFenStringToBoard(corpus->fens[i], &corpus->boards[i]);
+        corpus->moves[i].length = 0;
+        generateMoves(&corpus->moves[i], &corpus->boards[i]);
+    }
+
+    if (json != NULL) fprintf(json, "{\n  \"context\": {\n    \"positions\": %d,\n    \"samples\": %d\n  },\n  \"benchmarks\": [", BENCH_POSITIONS, MICRO_SAMPLES);
+    printf("%-24s %10s %10s %10s %8s\n", "benchmark", "ns/call", "deviation", "baseline", "change");
+    bool first = true;
+    for (int i = 0; i < MICROBENCHMARKS; i++) {
+        if (!strstr(microbenchmarks[i].name, filter)) continue;
+        unsigned long long int calls;
+        double deviation;
+        double time = runMicrobenchmark(corpus, &microbenchmarks[i], &calls, &deviation);
+        printf("%-24s %10.2f %9.1f%%", microbenchmarks[i].name, time, deviation);
+        double baselineNs = (baseline != NULL) ? baselineTime(baseline, microbenchmarks[i].name) : -1;
+        if (baselineNs > 0) printf(" %10.2f %+7.1f%%\n", baselineNs, (time - baselineNs) * 100 / baselineNs);
+        else printf("\n");
+        fflush(stdout);
+        if (json != NULL) {
+            fprintf(json, "%s\n    {\"name\": ", (first) ? "" : ",");
+            printJsonString(json, microbenchmarks[i].name);
+            fprintf(json, ", \"iterations\": %llu, \"real_time\": %.3f, \"deviation_percent\": %.1f, \"time_unit\": \"ns\"}", calls, time, deviation);
+        }
+        first = false;
+    }
+    if (json != NULL) {
+        fprintf(json, "\n  ]\n}\n");
+        fclose(json);
+    }
+
+    for (int i = 0; i < BENCH_POSITIONS; i++) destroyUndoStack(&(corpus->boards[i].history));
+    destroyUndoStack(&(corpus->scratch.history));
+    alignedFree(corpus);
+    free(baseline);
+    return 0;
+}
+#endif
+
+int main(int argc, char **argv) {
+    Board* mainBoard;
     mainBoard = (Board*)malloc(sizeof(Board));
     if (mainBoard == NULL) {
         printf("couldn't initialize the chess board.");
         return 1;
     }
     char pieceSymbols[15];
+    initSliderAttacks();
+    initZobrist();
+    initEvaluation();
+    initNnue();
+    initStats();
+    if (!initTranspositionTable(&tt, 16)) {
+        printf("couldn't allocate the hash table.");
+        return 1;
+    }
     initBoardState(mainBoard, pieceSymbols);
+    int exitCode = 0;
 
-    // Create a new thread
-    Parameters paramsIO;
-    paramsIO.board = mainBoard;
-    paramsIO.pieceSymbols = pieceSymbols;
-    HANDLE hThread = CreateThread(
-        NULL,    // Thread attributes
-        0,       // Stack size (0 = use default)
-        ioThread, // Thread start address
-        &paramsIO,    // Parameter to pass to the thread
-        0,       // Creation flags
-        NULL);   // Thread id
-    if (hThread == NULL)
-    {
-        // Thread creation failed.
-        // More details can be retrieved by calling GetLastError()
-        printf("couldn't create IO thread");
-        return 1;
+#ifdef MCE_MICROBENCH
+    exitCode = runMicrobenchmarks(argc, argv);
+#else
+    if (argc >= 3 && !strcmp(argv[1], "perftsuite")) {
+        // Batch mode for scripts: perftsuite <file> [depth=<max>] [threads=<count>], exits with 1 on any failure
+        int maxDepth = MAX_PLY, threadCount = cpuCount();
+        for (int i = 3; i < argc; i++) {
+            if (!memcmp(argv[i], "depth=", 6)) parseInt(argv[i] + 6, &maxDepth);
+            else if (!memcmp(argv[i], "threads=", 8)) parseInt(argv[i] + 8, &threadCount);
+        }
+        if (threadCount < 1) threadCount = 1;
+        int failed = runPerftSuite(argv[2], maxDepth, threadCount);
+        if (failed < 0) fprintf(stderr, "couldn't read %s\n", argv[2]);
+        exitCode = failed != 0;
+    }
+    else if (argc >= 2 && !strcmp(argv[1], "bench")) {
+        // bench [runs] [depth=<plies>], for scripts and PGO training
+        int runs = 1, depth = BENCH_DEPTH;
+        for (int i = 2; i < argc; i++) {
+            if (!memcmp(argv[i], "depth=", 6)) parseInt(argv[i] + 6, &depth);
+            else parseInt(argv[i], &runs);
+        }
+        bench(mainBoard, runs, depth);
+    }
+    else {
+        // Create a new thread
+        Parameters paramsIO;
+        paramsIO.board = mainBoard;
+        paramsIO.pieceSymbols = pieceSymbols;
+        Thread ioThreadHandle;
+        if (!startThread(&ioThreadHandle, ioThread, &paramsIO))
+        {
+            // Thread creation failed.
+            printf("couldn't create IO thread");
+            return 1;
+        }
+        joinThread(ioThreadHandle);
     }
+#endif
 
-    WaitForSingleObject(hThread, INFINITE);
-    CloseHandle(hThread);
-    destroyMoveList(&(mainBoard->history));
+    destroyUndoStack(&(mainBoard->history));
     free(mainBoard);
+    alignedFree(tt.buckets);
+    unloadNetwork();
+#ifdef _MSC_VER
     _CrtDumpMemoryLeaks();
+#endif
+    return exitCode;
 }
\ No newline at end of file